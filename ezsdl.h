@@ -8,6 +8,7 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #ifndef EZSDL_BITDEPTH
@@ -102,6 +103,422 @@ static inline unsigned* bmp4_scanline(bmp4* b, int y) {
 	return &b->data[y * b->width];
 }
 
+/* nearest neighbour: stretches a row of src_w pixels to dst_w and stores
+   n pixels of the result, starting at column x, to dst. */
+static inline void bmp4_stretch_row(const unsigned *src, unsigned src_w,
+				    unsigned *dst, unsigned dst_w, unsigned x, unsigned n) {
+	unsigned long long step = ((unsigned long long) src_w << 16) / dst_w;
+	unsigned long long pos = x * step;
+	for(; n; n--, pos += step) *(dst++) = src[pos >> 16];
+}
+
+/* row kernels to blit n 32 bit pixels: copies, fills, and the expansion
+   of 1 bit (most significant first, starting at bit x) and 8 bit palette
+   indices. bmp4_resample() has its own: blends of two rows and sums of
+   the channels of a row. with gcc or clang on x86 the AVX2 versions are
+   used if the cpu has it, which is checked at runtime, else the SSE2 ones
+   if they are compiled in, else plain C. */
+
+/* a + (b - a) * f / 128 for each channel, f in 0..127 */
+static inline unsigned bmp4_blend(unsigned a, unsigned b, int f) {
+	unsigned res = 0, i;
+	for(i = 0; i < 32; i += 8) {
+		int ca = a >> i & 255, cb = b >> i & 255;
+		res |= (unsigned) (ca + ((cb - ca) * f >> 7)) << i;
+	}
+	return res;
+}
+
+static inline void bmp4_sum_row_c(unsigned *acc, const unsigned *src, size_t n) {
+	for(; n; n--, acc += 4, src++) {
+		acc[0] += *src & 255;
+		acc[1] += *src >> 8 & 255;
+		acc[2] += *src >> 16 & 255;
+		acc[3] += *src >> 24;
+	}
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP4_AVX2
+#include <immintrin.h>
+
+static inline int bmp4_has_avx2(void) {
+	static int has = -1;
+	if(has < 0) has = __builtin_cpu_supports("avx2");
+	return has;
+}
+
+__attribute__((target("avx2")))
+static void bmp4_copy_row_avx2(unsigned *dst, const unsigned *src, size_t n) {
+	for(; n >= 16; n -= 16, src += 16, dst += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) src);
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + 8));
+		_mm256_storeu_si256((__m256i*) dst, a);
+		_mm256_storeu_si256((__m256i*) (dst + 8), b);
+	}
+	for(; n; n--) *dst++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void bmp4_fill_row_avx2(unsigned *dst, size_t n, unsigned col) {
+	__m256i c = _mm256_set1_epi32(col);
+	for(; n >= 8; n -= 8, dst += 8)
+		_mm256_storeu_si256((__m256i*) dst, c);
+	for(; n; n--) *dst++ = col;
+}
+
+__attribute__((target("avx2")))
+static void bmp4_mono_row_avx2(unsigned *dst, const unsigned char *bits, unsigned x,
+			       size_t n, const unsigned pal[2]) {
+	const __m256i mask = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	__m256i p0 = _mm256_set1_epi32(pal[0]), p1 = _mm256_set1_epi32(pal[1]), m;
+	for(; n && (x & 7); n--, x++) *dst++ = pal[bits[x >> 3] >> (7 - (x & 7)) & 1];
+	for(bits += x >> 3; n >= 8; n -= 8, x += 8, dst += 8) {
+		m = _mm256_and_si256(_mm256_set1_epi32(*bits++), mask);
+		m = _mm256_cmpeq_epi32(m, mask);
+		_mm256_storeu_si256((__m256i*) dst, _mm256_blendv_epi8(p0, p1, m));
+	}
+	for(bits -= x >> 3; n; n--, x++) *dst++ = pal[bits[x >> 3] >> (7 - (x & 7)) & 1];
+}
+
+__attribute__((target("avx2")))
+static void bmp4_pal8_row_avx2(unsigned *dst, const unsigned char *src, size_t n, const unsigned *pal) {
+	for(; n >= 8; n -= 8, src += 8, dst += 8) {
+		__m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) src));
+		_mm256_storeu_si256((__m256i*) dst, _mm256_i32gather_epi32((const int*) pal, i, 4));
+	}
+	for(; n; n--) *dst++ = pal[*src++];
+}
+
+/* weights are 7 bit, so the products fit signed 16 bit lanes. unpacking
+   works within 128 bit lanes, and packing undoes it the same way. */
+__attribute__((target("avx2")))
+static inline __m256i bmp4_blend_avx2(__m256i a, __m256i b, __m256i wlo, __m256i whi) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_unpacklo_epi8(a, zero), hi = _mm256_unpackhi_epi8(a, zero);
+	lo = _mm256_add_epi16(lo, _mm256_srai_epi16(_mm256_mullo_epi16(
+		_mm256_sub_epi16(_mm256_unpacklo_epi8(b, zero), lo), wlo), 7));
+	hi = _mm256_add_epi16(hi, _mm256_srai_epi16(_mm256_mullo_epi16(
+		_mm256_sub_epi16(_mm256_unpackhi_epi8(b, zero), hi), whi), 7));
+	return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void bmp4_blend_row_avx2(unsigned *dst, const unsigned *a, const unsigned *b, size_t n, int f) {
+	const __m256i w = _mm256_set1_epi16(f);
+	for(; n >= 8; n -= 8, a += 8, b += 8, dst += 8)
+		_mm256_storeu_si256((__m256i*) dst, bmp4_blend_avx2(_mm256_loadu_si256((const __m256i*) a),
+								    _mm256_loadu_si256((const __m256i*) b), w, w));
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, f);
+}
+
+__attribute__((target("avx2")))
+static void bmp4_blend_row_w_avx2(unsigned *dst, const unsigned *a, const unsigned *b, size_t n,
+				  const unsigned short *f) {
+	for(; n >= 8; n -= 8, a += 8, b += 8, f += 8, dst += 8) {
+		/* each weight in both halves of its 32 bit lane, then spread
+		   over the four channels of its pixel */
+		__m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) f));
+		w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+		_mm256_storeu_si256((__m256i*) dst, bmp4_blend_avx2(_mm256_loadu_si256((const __m256i*) a),
+								    _mm256_loadu_si256((const __m256i*) b),
+								    _mm256_unpacklo_epi32(w, w),
+								    _mm256_unpackhi_epi32(w, w)));
+	}
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, *f++);
+}
+
+__attribute__((target("avx2")))
+static void bmp4_sum_row_avx2(unsigned *acc, const unsigned *src, size_t n) {
+	size_t i;
+	for(; n >= 8; n -= 8, src += 8, acc += 32)
+		for(i = 0; i < 4; i++) {
+			__m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (src + 2 * i)));
+			__m256i *d = (__m256i*) (acc + 8 * i);
+			_mm256_storeu_si256(d, _mm256_add_epi32(_mm256_loadu_si256(d), p));
+		}
+	bmp4_sum_row_c(acc, src, n);
+}
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline __m128i bmp4_blend_sse2(__m128i a, __m128i b, __m128i wlo, __m128i whi) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(a, zero), hi = _mm_unpackhi_epi8(a, zero);
+	lo = _mm_add_epi16(lo, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(b, zero), lo), wlo), 7));
+	hi = _mm_add_epi16(hi, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(b, zero), hi), whi), 7));
+	return _mm_packus_epi16(lo, hi);
+}
+
+static inline void bmp4_blend_row_vec(unsigned *dst, const unsigned *a, const unsigned *b, size_t n, int f) {
+	const __m128i w = _mm_set1_epi16(f);
+	for(; n >= 4; n -= 4, a += 4, b += 4, dst += 4)
+		_mm_storeu_si128((__m128i*) dst, bmp4_blend_sse2(_mm_loadu_si128((const __m128i*) a),
+								 _mm_loadu_si128((const __m128i*) b), w, w));
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, f);
+}
+
+static inline void bmp4_blend_row_w_vec(unsigned *dst, const unsigned *a, const unsigned *b, size_t n,
+					const unsigned short *f) {
+	for(; n >= 4; n -= 4, a += 4, b += 4, f += 4, dst += 4) {
+		__m128i w = _mm_loadl_epi64((const __m128i*) f);
+		w = _mm_unpacklo_epi16(w, w);
+		_mm_storeu_si128((__m128i*) dst, bmp4_blend_sse2(_mm_loadu_si128((const __m128i*) a),
+								 _mm_loadu_si128((const __m128i*) b),
+								 _mm_unpacklo_epi32(w, w), _mm_unpackhi_epi32(w, w)));
+	}
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, *f++);
+}
+
+static inline void bmp4_sum_row_vec(unsigned *acc, const unsigned *src, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i p, lo, hi, *d = (__m128i*) acc;
+	for(; n >= 4; n -= 4, src += 4, d += 4) {
+		p = _mm_loadu_si128((const __m128i*) src);
+		lo = _mm_unpacklo_epi8(p, zero);
+		hi = _mm_unpackhi_epi8(p, zero);
+		_mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d), _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(d + 1, _mm_add_epi32(_mm_loadu_si128(d + 1), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(d + 2, _mm_add_epi32(_mm_loadu_si128(d + 2), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(d + 3, _mm_add_epi32(_mm_loadu_si128(d + 3), _mm_unpackhi_epi16(hi, zero)));
+	}
+	bmp4_sum_row_c((unsigned*) d, src, n);
+}
+
+static inline void bmp4_copy_row_vec(unsigned *dst, const unsigned *src, size_t n) {
+	for(; n >= 8; n -= 8, src += 8, dst += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*) src);
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + 4));
+		_mm_storeu_si128((__m128i*) dst, a);
+		_mm_storeu_si128((__m128i*) (dst + 4), b);
+	}
+	for(; n; n--) *dst++ = *src++;
+}
+
+static inline void bmp4_fill_row_vec(unsigned *dst, size_t n, unsigned col) {
+	__m128i c = _mm_set1_epi32(col);
+	for(; n >= 4; n -= 4, dst += 4)
+		_mm_storeu_si128((__m128i*) dst, c);
+	for(; n; n--) *dst++ = col;
+}
+
+static inline void bmp4_mono_row_vec(unsigned *dst, const unsigned char *bits, unsigned x,
+				     size_t n, const unsigned pal[2]) {
+	const __m128i hi = _mm_set_epi32(16, 32, 64, 128), lo = _mm_set_epi32(1, 2, 4, 8);
+	__m128i p0 = _mm_set1_epi32(pal[0]), p1 = _mm_set1_epi32(pal[1]), b, m;
+	for(; n && (x & 7); n--, x++) *dst++ = pal[bits[x >> 3] >> (7 - (x & 7)) & 1];
+	for(bits += x >> 3; n >= 8; n -= 8, x += 8, dst += 8) {
+		b = _mm_set1_epi32(*bits++);
+		m = _mm_cmpeq_epi32(_mm_and_si128(b, hi), hi);
+		_mm_storeu_si128((__m128i*) dst, _mm_or_si128(_mm_andnot_si128(m, p0), _mm_and_si128(m, p1)));
+		m = _mm_cmpeq_epi32(_mm_and_si128(b, lo), lo);
+		_mm_storeu_si128((__m128i*) (dst + 4), _mm_or_si128(_mm_andnot_si128(m, p0), _mm_and_si128(m, p1)));
+	}
+	for(bits -= x >> 3; n; n--, x++) *dst++ = pal[bits[x >> 3] >> (7 - (x & 7)) & 1];
+}
+#else
+static inline void bmp4_copy_row_vec(unsigned *dst, const unsigned *src, size_t n) {
+	memcpy(dst, src, n * 4);
+}
+
+static inline void bmp4_fill_row_vec(unsigned *dst, size_t n, unsigned col) {
+	for(; n; n--) *dst++ = col;
+}
+
+static inline void bmp4_mono_row_vec(unsigned *dst, const unsigned char *bits, unsigned x,
+				     size_t n, const unsigned pal[2]) {
+	for(; n; n--, x++) *dst++ = pal[bits[x >> 3] >> (7 - (x & 7)) & 1];
+}
+
+static inline void bmp4_blend_row_vec(unsigned *dst, const unsigned *a, const unsigned *b, size_t n, int f) {
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, f);
+}
+
+static inline void bmp4_blend_row_w_vec(unsigned *dst, const unsigned *a, const unsigned *b, size_t n,
+					const unsigned short *f) {
+	for(; n; n--) *dst++ = bmp4_blend(*a++, *b++, *f++);
+}
+
+static inline void bmp4_sum_row_vec(unsigned *acc, const unsigned *src, size_t n) {
+	bmp4_sum_row_c(acc, src, n);
+}
+#endif
+
+static inline void bmp4_copy_row(unsigned *dst, const unsigned *src, size_t n) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_copy_row_avx2(dst, src, n);
+		return;
+	}
+#endif
+	bmp4_copy_row_vec(dst, src, n);
+}
+
+static inline void bmp4_fill_row(unsigned *dst, size_t n, unsigned col) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_fill_row_avx2(dst, n, col);
+		return;
+	}
+#endif
+	bmp4_fill_row_vec(dst, n, col);
+}
+
+static inline void bmp4_mono_row(unsigned *dst, const unsigned char *bits, unsigned x,
+				 size_t n, const unsigned pal[2]) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_mono_row_avx2(dst, bits, x, n, pal);
+		return;
+	}
+#endif
+	bmp4_mono_row_vec(dst, bits, x, n, pal);
+}
+
+/* blends row a towards row b by f / 128 */
+static inline void bmp4_blend_row(unsigned *dst, const unsigned *a, const unsigned *b, size_t n, int f) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_blend_row_avx2(dst, a, b, n, f);
+		return;
+	}
+#endif
+	bmp4_blend_row_vec(dst, a, b, n, f);
+}
+
+/* the same with a weight for each pixel */
+static inline void bmp4_blend_row_w(unsigned *dst, const unsigned *a, const unsigned *b, size_t n,
+				    const unsigned short *f) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_blend_row_w_avx2(dst, a, b, n, f);
+		return;
+	}
+#endif
+	bmp4_blend_row_w_vec(dst, a, b, n, f);
+}
+
+/* adds the channels of each pixel of src to the four counters acc has
+   for it */
+static inline void bmp4_sum_row(unsigned *acc, const unsigned *src, size_t n) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_sum_row_avx2(acc, src, n);
+		return;
+	}
+#endif
+	bmp4_sum_row_vec(acc, src, n);
+}
+
+/* dst = src where mask is set, src is expected to be masked already */
+#ifdef __SSE2__
+static inline void bmp4_masked_row(unsigned *dst, const unsigned *src, const unsigned *mask, size_t n) {
+	for(; n >= 4; n -= 4, dst += 4, src += 4, mask += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i*) dst);
+		__m128i m = _mm_loadu_si128((const __m128i*) mask);
+		d = _mm_or_si128(_mm_andnot_si128(m, d), _mm_loadu_si128((const __m128i*) src));
+		_mm_storeu_si128((__m128i*) dst, d);
+	}
+	for(; n; n--, dst++) *dst = (*dst & ~*mask++) | *src++;
+}
+#else
+static inline void bmp4_masked_row(unsigned *dst, const unsigned *src, const unsigned *mask, size_t n) {
+	for(; n; n--, dst++) *dst = (*dst & ~*mask++) | *src++;
+}
+#endif
+
+/* there is no gather before AVX2 */
+static inline void bmp4_pal8_row(unsigned *dst, const unsigned char *src, size_t n, const unsigned *pal) {
+#ifdef BMP4_AVX2
+	if(bmp4_has_avx2()) {
+		bmp4_pal8_row_avx2(dst, src, n, pal);
+		return;
+	}
+#endif
+	for(; n; n--) *dst++ = pal[*src++];
+}
+
+/* resamples a sw x sh picture to dw x dh. enlarging is bilinear,
+   shrinking averages the box of source pixels behind each destination
+   pixel. all four channels are treated alike. both are done a row at a
+   time: the two source rows are blended, then the columns, or the rows
+   of a box are summed up per column, then the columns. returns 0 if
+   there is no memory for that. */
+static inline int bmp4_resample(const unsigned *src, unsigned sw, unsigned sh,
+				unsigned *dst, unsigned dw, unsigned dh) {
+	unsigned x, y, i;
+	if(dw >= sw && dh >= sh) {
+		/* centers of the destination pixels in 16.16 source coordinates */
+		long long sx = ((long long) sw << 16) / dw, sy = ((long long) sh << 16) / dh;
+		unsigned *col = malloc((size_t) dw * sizeof *col);
+		unsigned short *fx = malloc((size_t) dw * sizeof *fx);
+		unsigned *v = malloc((size_t) sw * 4), *l = malloc((size_t) dw * 4), *r = malloc((size_t) dw * 4);
+		int ok = col && fx && v && l && r;
+		for(x = 0; ok && x < dw; x++) {
+			long long f = MAX(x * sx + sx / 2 - 32768, 0);
+			col[x] = f >> 16;
+			fx[x] = (f >> 9) & 127;
+			/* the last column has no right neighbour */
+			if(col[x] + 1 >= sw) {
+				col[x] = sw - 1;
+				fx[x] = 0;
+			}
+		}
+		for(y = 0; ok && y < dh; y++, dst += dw) {
+			long long fy = MAX(y * sy + sy / 2 - 32768, 0);
+			unsigned y0 = MIN(fy >> 16, sh - 1), y1 = MIN(y0 + 1, sh - 1);
+			bmp4_blend_row(v, src + (size_t) y0 * sw, src + (size_t) y1 * sw, sw, (fy >> 9) & 127);
+			for(x = 0; x < dw; x++) {
+				l[x] = v[col[x]];
+				r[x] = v[MIN(col[x] + 1, sw - 1)];
+			}
+			bmp4_blend_row_w(dst, l, r, dw, fx);
+		}
+		free(col);
+		free(fx);
+		free(v);
+		free(l);
+		free(r);
+		return ok;
+	}
+	unsigned *acc = malloc((size_t) sw * 4 * sizeof *acc);
+	unsigned long long last = 0, inv = 0;
+	if(!acc) return 0;
+	for(y = 0; y < dh; y++, dst += dw) {
+		unsigned y0 = (unsigned long long) y * sh / dh;
+		unsigned y1 = MAX((unsigned long long) (y + 1) * sh / dh, y0 + 1);
+		memset(acc, 0, (size_t) sw * 4 * sizeof *acc);
+		for(i = y0; i < y1; i++)
+			bmp4_sum_row(acc, src + (size_t) i * sw, sw);
+		for(x = 0; x < dw; x++) {
+			unsigned x0 = (unsigned long long) x * sw / dw;
+			unsigned x1 = MAX((unsigned long long) (x + 1) * sw / dw, x0 + 1);
+			unsigned long long sum[4] = {0}, n = (unsigned long long) (x1 - x0) * (y1 - y0);
+			unsigned res = 0;
+			/* divide by multiplying with the reciprocal of n, rounded
+			   up, which is exact as long as n < 4096. boxes come in
+			   at most two sizes per row. */
+			if(n != last) {
+				inv = ((1ULL << 32) + n - 1) / n;
+				last = n;
+			}
+			for(i = x0 * 4; i < x1 * 4; i += 4) {
+				sum[0] += acc[i];
+				sum[1] += acc[i + 1];
+				sum[2] += acc[i + 2];
+				sum[3] += acc[i + 3];
+			}
+			for(i = 0; i < 4; i++)
+				res |= (unsigned) (n < 4096 ? (sum[i] + n / 2) * inv >> 32 : (sum[i] + n / 2) / n) << (i * 8);
+			dst[x] = res;
+		}
+	}
+	free(acc);
+	return 1;
+}
+
 typedef struct bmp3 {
 	unsigned width, height;
 	unsigned char *data;
@@ -205,6 +622,11 @@ typedef struct display {
 	int flags;
 	unsigned hwscale; // hardware scaling in percent
 	enum resize_method rm;
+	unsigned epoch; // bumped whenever display_init() runs
+	/* the vram held between display_begin_frame() and display_end_frame() */
+	void *frame_pixels;
+	unsigned frame_pitch;
+	int frame_depth;
 } display;
 
 static inline void display_set_resize_method(display *d, enum resize_method rm) {
@@ -246,6 +668,8 @@ static inline void display_init(display *d, unsigned width, unsigned height, uns
 	if(d->ren)
 		SDL_DestroyRenderer(d->ren);
 	d->ren = SDL_CreateRenderer(d->win, -1, SDL_RENDERER_ACCELERATED|SDL_RENDERER_TARGETTEXTURE);
+	/* no GPU, the software renderer does as well */
+	if(!d->ren) d->ren = SDL_CreateRenderer(d->win, -1, SDL_RENDERER_SOFTWARE);
 	d->tex = SDL_CreateTexture(d->ren, EZSDL_PIXEL_FMT, SDL_TEXTUREACCESS_STREAMING, width, height);
 #else
 	d->surface = SDL_SetVideoMode(width, height, EZSDL_BITDEPTH, flags);
@@ -256,6 +680,7 @@ static inline void display_init(display *d, unsigned width, unsigned height, uns
 	d->fs = 0;
 	d->flags = flags;
 	d->hwscale = hwscale;
+	d->epoch++;
 }
 
 static inline void display_toggle_fullscreen_i(display *d, int update);
@@ -266,6 +691,11 @@ static inline void display_shutdown(display *d) {
 
 static inline void display_get_vram_and_pitch(display *d, void** pixels, unsigned *pitch)
 {
+	if(d->frame_depth) {
+		*pixels = d->frame_pixels;
+		*pitch = d->frame_pitch;
+		return;
+	}
 #ifdef USE_SDL2
 	SDL_LockTexture(d->tex, 0, pixels, pitch);
 #else
@@ -275,11 +705,43 @@ static inline void display_get_vram_and_pitch(display *d, void** pixels, unsigne
 }
 
 static inline void display_release_vram(display *d) {
+	if(d->frame_depth) return;
 #ifdef USE_SDL2
 	SDL_UnlockTexture(d->tex);
 #endif
 }
 
+/* locks the vram once for everything drawn until display_end_frame().
+   every primitive in between draws into the held vram instead of
+   locking it on its own. frames nest, the outermost one unlocks. the
+   frame has to end before the display is updated. */
+static inline void display_begin_frame(display *d) {
+	if(!d->frame_depth)
+		display_get_vram_and_pitch(d, &d->frame_pixels, &d->frame_pitch);
+	d->frame_depth++;
+}
+
+static inline void display_end_frame(display *d) {
+	assert(d->frame_depth > 0);
+	if(--d->frame_depth) return;
+	display_release_vram(d);
+	d->frame_pixels = 0;
+}
+
+/* channel masks of the display's pixel format: red, green, blue, alpha */
+static inline void display_get_pixel_masks(display *d, unsigned masks[4]) {
+#ifdef USE_SDL2
+	int bpp;
+	SDL_PixelFormatEnumToMasks(EZSDL_PIXEL_FMT, &bpp, (Uint32*)&masks[0],
+		(Uint32*)&masks[1], (Uint32*)&masks[2], (Uint32*)&masks[3]);
+#else
+	masks[0] = d->surface->format->Rmask;
+	masks[1] = d->surface->format->Gmask;
+	masks[2] = d->surface->format->Bmask;
+	masks[3] = d->surface->format->Amask;
+#endif
+}
+
 static inline unsigned display_get_width(display *d) {
 	return d->width;
 }
@@ -346,6 +808,66 @@ static inline void display_draw_sprite(display *d, struct spritesheet* ss, unsig
 	display_release_vram(d);
 }
 
+/* the sprites of a spritesheet expanded once for one scale, so text can
+   be drawn a whole glyph row at a time. pixels holds the sprites one
+   after the other, w x h each, in display format and with what is
+   transparent cleared. mask is all ones where the sprite covers. */
+struct glyph_atlas {
+	unsigned count, w, h;
+	unsigned *pixels, *mask;
+};
+
+static inline int glyph_atlas_init(struct glyph_atlas *a, struct spritesheet *ss, unsigned scale) {
+	unsigned g, x, y, col, transp_col = ss->bitmap->data[0];
+	size_t i;
+	if(!scale) scale = 1;
+	a->count = ss->sprite_count;
+	a->w = ss->sprite_w * scale;
+	a->h = ss->sprite_h * scale;
+	a->pixels = malloc((size_t) a->count * a->w * a->h * sizeof *a->pixels);
+	a->mask = malloc((size_t) a->count * a->w * a->h * sizeof *a->mask);
+	if(!a->pixels || !a->mask) {
+		free(a->pixels);
+		free(a->mask);
+		a->pixels = a->mask = 0;
+		return 0;
+	}
+	for(g = 0, i = 0; g < a->count; g++)
+		for(y = 0; y < a->h; y++)
+			for(x = 0; x < a->w; x++, i++) {
+				col = ss->bitmap->data[spritesheet_getspritestart(ss, g, y / scale) + x / scale];
+				a->mask[i] = col == transp_col ? 0 : ~0U;
+				a->pixels[i] = rgba_to_argb(col) & a->mask[i];
+			}
+	return 1;
+}
+
+static inline void glyph_atlas_free(struct glyph_atlas *a) {
+	free(a->pixels);
+	free(a->mask);
+	a->pixels = a->mask = 0;
+}
+
+/* draws text up to its end or a newline at sx, sy. glyphs that don't
+   fit the display are left out, like with display_draw_sprite(). */
+static inline void display_draw_text(display *d, struct glyph_atlas *a, const char *text, unsigned sx, unsigned sy) {
+	unsigned y, pitch, g;
+	size_t off;
+	unsigned *vram;
+	void *pixels;
+	if(sy + a->h > d->height) return;
+	display_get_vram_and_pitch(d, &pixels, &pitch);
+	pitch /= sizeof(unsigned);
+	vram = (unsigned*)pixels + sy * pitch;
+	for(; *text && *text != '\n' && sx + a->w <= d->width; text++, sx += a->w) {
+		if((g = (unsigned char) *text) >= a->count) continue;
+		off = (size_t) g * a->w * a->h;
+		for(y = 0; y < a->h; y++, off += a->w)
+			bmp4_masked_row(vram + y * pitch + sx, a->pixels + off, a->mask + off, a->w);
+	}
+	display_release_vram(d);
+}
+
 static inline void display_draw(display *d, bmp4* b, unsigned sx, unsigned sy, unsigned scale) {
 	if(!scale) scale = 1;
 	assert(d->width >= sx+b->width*scale && d->height >= sy+b->height*scale);
@@ -363,6 +885,20 @@ static inline void display_draw(display *d, bmp4* b, unsigned sx, unsigned sy, u
 	//SDL_UpdateRect(d->surface, sx, sy, b->width*scale, b->height*scale);
 }
 
+/* shifts the rows of the vram up by dy, or down if dy is negative, as
+   scrolling the picture down by dy does. the rows that come into view
+   keep what they had, the caller draws them anew. SDL1 only: the
+   memory of a locked SDL2 texture is write-only. */
+static inline void display_scroll_vram(display *d, int dy) {
+	void *pixels;
+	unsigned pitch, n = abs(dy);
+	if(!n || n >= d->height) return;
+	display_get_vram_and_pitch(d, &pixels, &pitch);
+	if(dy > 0) memmove(pixels, (char*)pixels + n*pitch, (size_t)(d->height - n)*pitch);
+	else memmove((char*)pixels + n*pitch, pixels, (size_t)(d->height - n)*pitch);
+	display_release_vram(d);
+}
+
 static inline void display_draw_vline(display *d, unsigned sx, unsigned sy, unsigned height, unsigned color, unsigned scale) {
 	void *pixels;
 	if(!scale) scale = 1;
@@ -407,6 +943,7 @@ static inline void display_fill_rect(display *d, unsigned sx, unsigned sy, unsig
 
 static inline void display_update_region(display *d, unsigned x, unsigned y, unsigned w, unsigned h)
 {
+	assert(!d->frame_depth);
 #ifdef USE_SDL2
 	SDL_Rect sarea = {.x = x, .y = y, .w = w, .h = h};
 	SDL_Rect darea = {
@@ -421,6 +958,58 @@ static inline void display_update_region(display *d, unsigned x, unsigned y, uns
 #endif
 }
 
+#ifdef USE_SDL2
+/* static textures, for pictures that are shown over and over, like the
+   pages of a book. they are uploaded once and composited by the renderer,
+   which works with the software renderer too. textures belong to the
+   renderer, which display_init() replaces: once d->epoch changed, the
+   ones made before are gone. */
+static inline SDL_Texture *display_new_texture(display *d, const unsigned *pixels,
+					       unsigned w, unsigned h, unsigned pitch) {
+	SDL_Texture *t = SDL_CreateTexture(d->ren, EZSDL_PIXEL_FMT, SDL_TEXTUREACCESS_STATIC, w, h);
+	if(!t) return 0;
+	SDL_SetTextureBlendMode(t, SDL_BLENDMODE_NONE);
+	if(SDL_UpdateTexture(t, 0, pixels, pitch)) {
+		SDL_DestroyTexture(t);
+		return 0;
+	}
+	return t;
+}
+
+static inline void display_free_texture(SDL_Texture *t) {
+	SDL_DestroyTexture(t);
+}
+
+static inline void display_scale_rect(display *d, SDL_Rect *r, int x, int y, int w, int h) {
+	int s = d->hwscale;
+	r->x = x * s / 100;
+	r->y = y * s / 100;
+	r->w = (x + w) * s / 100 - r->x;
+	r->h = (y + h) * s / 100 - r->y;
+}
+
+/* draws the sw x sh pixels at sx, sy of t stretched to dw x dh at dx, dy.
+   like display_fill_region() it goes to the renderer, not to the vram,
+   and shows up with display_present(). */
+static inline void display_draw_texture(display *d, SDL_Texture *t, int sx, int sy, int sw, int sh,
+					int dx, int dy, int dw, int dh) {
+	SDL_Rect sarea = {.x = sx, .y = sy, .w = sw, .h = sh}, darea;
+	display_scale_rect(d, &darea, dx, dy, dw, dh);
+	SDL_RenderCopy(d->ren, t, &sarea, &darea);
+}
+
+static inline void display_fill_region(display *d, int x, int y, int w, int h, unsigned color) {
+	SDL_Rect area;
+	display_scale_rect(d, &area, x, y, w, h);
+	SDL_SetRenderDrawColor(d->ren, (color >> 16) & 255, (color >> 8) & 255, color & 255, 255);
+	SDL_RenderFillRect(d->ren, &area);
+}
+
+static inline void display_present(display *d) {
+	SDL_RenderPresent(d->ren);
+}
+#endif
+
 static inline void display_refresh(display *d) {
 	display_update_region(d, 0, 0, d->width, d->height);
 }
@@ -432,9 +1021,9 @@ static inline void display_clear(display *d) {
 	display_get_vram_and_pitch(d, &pixels, &pitch);
 	ptr = pixels;
 	pitch /= sizeof(unsigned);
-	unsigned x, y;
-	for(y = 0; y < d->height; y++) for (x = 0; x < d->width; x++)
-		ptr[y*pitch + x] = 0;
+	unsigned y;
+	for(y = 0; y < d->height; y++)
+		bmp4_fill_row(ptr + y*pitch, d->width, 0);
 	display_release_vram(d);
 }
 
@@ -596,6 +1185,18 @@ static inline void ezsdl_draw(bmp4*b, unsigned x, unsigned y, int scale) {
 	display_draw(&ezsdl.disp, b, x, y, scale);
 }
 
+static inline void ezsdl_begin_frame(void) {
+	display_begin_frame(&ezsdl.disp);
+}
+
+static inline void ezsdl_end_frame(void) {
+	display_end_frame(&ezsdl.disp);
+}
+
+static inline void ezsdl_scroll_vram(int dy) {
+	display_scroll_vram(&ezsdl.disp, dy);
+}
+
 static inline void ezsdl_draw_vline(unsigned sx, unsigned sy, unsigned height, unsigned color, unsigned scale) {
 	display_draw_vline(&ezsdl.disp, sx, sy, height, color, scale);
 }
@@ -612,6 +1213,10 @@ static inline void ezsdl_draw_sprite(struct spritesheet* ss, unsigned sprite_no,
 	display_draw_sprite(&ezsdl.disp, ss, sprite_no, x, y, scale);
 }
 
+static inline void ezsdl_draw_text(struct glyph_atlas *a, const char *text, unsigned x, unsigned y) {
+	display_draw_text(&ezsdl.disp, a, text, x, y);
+}
+
 static inline bmp4* ezsdl_get_screenshot(void) {
 	return display_get_screenshot(&ezsdl.disp);
 }
@@ -632,6 +1237,33 @@ static inline void ezsdl_update_region(unsigned x, unsigned y, unsigned w, unsig
 	display_update_region(&ezsdl.disp, x, y, w, h);
 }
 
+#ifdef USE_SDL2
+static inline SDL_Texture *ezsdl_new_texture(const unsigned *pixels, unsigned w, unsigned h, unsigned pitch) {
+	return display_new_texture(&ezsdl.disp, pixels, w, h, pitch);
+}
+
+static inline void ezsdl_free_texture(SDL_Texture *t) {
+	display_free_texture(t);
+}
+
+static inline void ezsdl_draw_texture(SDL_Texture *t, int sx, int sy, int sw, int sh,
+				      int dx, int dy, int dw, int dh) {
+	display_draw_texture(&ezsdl.disp, t, sx, sy, sw, sh, dx, dy, dw, dh);
+}
+
+static inline void ezsdl_fill_region(int x, int y, int w, int h, unsigned color) {
+	display_fill_region(&ezsdl.disp, x, y, w, h, color);
+}
+
+static inline void ezsdl_present(void) {
+	display_present(&ezsdl.disp);
+}
+#endif
+
+static inline unsigned ezsdl_get_epoch(void) {
+	return ezsdl.disp.epoch;
+}
+
 static inline void ezsdl_setcb(enum cbtypes type, eventcallbackfunc cb, void* data) {
 	inp_setcb(&ezsdl.inp, type, cb, data);
 }
@@ -648,6 +1280,10 @@ static inline void ezsdl_release_vram(void) {
 	display_release_vram(&ezsdl.disp);
 }
 
+static inline void ezsdl_get_pixel_masks(unsigned masks[4]) {
+	display_get_pixel_masks(&ezsdl.disp, masks);
+}
+
 static inline unsigned ezsdl_get_width(void) {
 	return display_get_width(&ezsdl.disp);
 }
@@ -9,18 +9,32 @@
 #include <stdarg.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <libdjvu/ddjvuapi.h>
 #include <mupdf/fitz.h>
 #include "ezsdl.h"
 #include "topaz.h"
 
-#pragma RcB2 LINK "-ldjvulibre" "-lSSL" "-lmupdf"
+#pragma RcB2 LINK "-ldjvulibre" "-lSSL" "-lmupdf" "-lpthread"
 
 static struct config_data {
 	int w, h;
 	int scale;
+	int cache_mb;
+	/* budget of the compressed cache tier, negative to disable it */
+	int zcache_mb;
+	int threads;
+	int stats;
+	/* directory rendered pages are kept in across sessions, if set */
+	char disk_cache[256];
+	int disk_cache_mb;
 } config_data;
 
 enum be_type {
@@ -54,12 +68,121 @@ static int scroll_line_v;
 static int scroll_line_h;
 static const int fps = 64;
 static ddjvu_rect_t page_dims;
-static unsigned *image_data;
+
+/* a rendered page, owned by the page cache */
+struct cache_entry {
+	struct cache_entry *prev, *next;
+	int page, scale;
+	/* -1 for a whole page, else the index of the tile it holds */
+	int tile;
+	/* rendered to a forced size instead of its natural one */
+	int forced;
+	int refs;
+	/* size of the whole page, even for a tile */
+	ddjvu_rect_t dims;
+	/* pixels in format, see entry_span() */
+	void *data;
+	int format;
+	/* npal colours. FMT_MONO always has room for two, a page of
+	   a single colour repeats it */
+	unsigned *pal;
+	int npal;
+	/* set if data lies in a mapped file of the disk cache */
+	void *map;
+	size_t map_len;
+	size_t size;
+	/* while in the compressed tier, the run-length coded size of data */
+	size_t zsize;
+	/* unique, set once it is in the cache */
+	unsigned long serial;
+};
+
+/* how a cache entry stores its pixels. pages made of few colours, like
+   bitonal scans or text, are kept as indices into a palette. */
+#define FMT_ARGB 0
+/* one byte per pixel */
+#define FMT_PAL8 1
+/* one bit per pixel, most significant bit first, rows padded to bytes */
+#define FMT_MONO 2
+
+/* the window on display: curr_page and the view_count-1 pages after it,
+   as many as can come into view while curr_page is on top, up to
+   VIEW_MAX. every page has its own buffer: small pages are shown from a
+   single one, pages too large for that from the tiles around the
+   viewport. */
+#define VIEW_MAX 16
+static int view_count;
+static struct view_slot {
+	/* -1 past the last page */
+	int page;
+	/* size the page is shown at, w is 0 while still unknown */
+	ddjvu_rect_t dims;
+	int tiled;
+	struct cache_entry *whole;
+	/* shown upscaled for whatever is still missing */
+	struct cache_entry *preview;
+	/* right after a zoom, the page at the previous scale resampled
+	   to dims, shown until the real one arrives */
+	unsigned *zoomed;
+	unsigned long zoomed_serial;
+	/* tiled pages: the grid of tiles kept, row-major */
+	int tx, ty, tw, th;
+	struct cache_entry **tiles;
+} view[VIEW_MAX];
+
+/* the document is laid out as one continuous strip of pages, each
+   centered in the width of the widest. page_top[i] is where page i
+   starts, page_top[page_count] the height of it all. pages whose size
+   is not known yet are assumed to be like the first one that is.
+   scroll_line_v is the offset of the viewport into curr_page. */
+static long long *page_top;
+static int layout_w, layout_scale, layout_dirty;
+/* bumped whenever the strip is laid out anew */
+static unsigned long layout_gen;
+
+static int layout_h(int pageno) {
+	return page_top[pageno + 1] - page_top[pageno];
+}
+
+/* the overview shows the document as a grid of thumbnails, which are
+   pages rendered to a forced size of at most THUMB_W x THUMB_H at
+   THUMB_SCALE. overview_y is how far the grid is scrolled down. thumbs
+   holds the borrowed thumbnails of the pages in view, by page.
+   UI thread only. */
+#define THUMB_W 120
+#define THUMB_H 160
+#define THUMB_GAP 16
+#define THUMB_SCALE 0
+#define CELL_W (THUMB_W + THUMB_GAP)
+#define CELL_H (THUMB_H + THUMB_GAP)
+static int overview, overview_sel;
+static long long overview_y;
+static struct cache_entry **thumbs;
+static unsigned long thumbs_generation;
+/* djvulibre's thumbnail of each page: 0 unless done, which it is
+   once rendering it can't block anymore. protected by cache.lock. */
+static signed char *thumb_state;
+/* set for pages mupdf can't load. they are drawn as placeholders and
+   never queued again. protected by cache.lock. */
+static unsigned char *page_broken;
+static void page_set_broken(int pageno);
+
+/* how far the render of the current page got, -1 unless one is running */
+static int render_progress = -1;
+static int pool_progress(int pageno);
 
 static void update_title(void) {
-	char buf[64];
-	snprintf(buf, sizeof buf, "SDLBook [%d/%d] (%d%%) %s",
-			curr_page, page_count, config_data.scale, filename);
+	char buf[96], prog[24] = "";
+	if(overview) {
+		snprintf(buf, sizeof buf, "SDLBook [overview %d/%d] %s",
+				overview_sel, page_count, filename);
+		ezsdl_set_title(buf);
+		return;
+	}
+	if((render_progress = pool_progress(curr_page)) >= 0)
+		snprintf(prog, sizeof prog, "rendering %d%% ", render_progress);
+	snprintf(buf, sizeof buf, "SDLBook [%d/%d] (%d%%) %s%s",
+			curr_page, page_count, config_data.scale, prog, filename);
 	ezsdl_set_title(buf);
 }
 
@@ -106,11 +229,23 @@ static void read_write_config(int doread) {
 			config_data.w = cfg_getint(config, "w");
 			config_data.h = cfg_getint(config, "h");
 			config_data.scale = cfg_getint(config, "scale");
+			config_data.cache_mb = cfg_getint(config, "cache_mb");
+			config_data.zcache_mb = cfg_getint(config, "zcache_mb");
+			config_data.threads = cfg_getint(config, "threads");
+			config_data.stats = cfg_getint(config, "stats");
+			cfg_getstr(config, "disk_cache", config_data.disk_cache, sizeof config_data.disk_cache);
+			config_data.disk_cache_mb = cfg_getint(config, "disk_cache_mb");
 		} else {
-			fprintf(config, "w=%d\nh=%d\nscale=%d\n",
+			fprintf(config, "w=%d\nh=%d\nscale=%d\ncache_mb=%d\nzcache_mb=%d\nthreads=%d\nstats=%d\ndisk_cache=%s\ndisk_cache_mb=%d\n",
 				ezsdl_get_width(),
 				ezsdl_get_height(),
-				config_data.scale);
+				config_data.scale,
+				config_data.cache_mb,
+				config_data.zcache_mb,
+				config_data.threads,
+				config_data.stats,
+				config_data.disk_cache,
+				config_data.disk_cache_mb);
 		}
 		cfg_close(config);
 	}
@@ -118,14 +253,20 @@ static void read_write_config(int doread) {
 		if(!config_data.w) config_data.w = 640;
 		if(!config_data.h) config_data.h = 480;
 		if(!config_data.scale) config_data.scale = 100;
+		if(!config_data.cache_mb) config_data.cache_mb = 256;
+		if(!config_data.zcache_mb) config_data.zcache_mb = 64;
+		if(!config_data.disk_cache_mb) config_data.disk_cache_mb = 1024;
 	}
 }
 
 static void handle(int);
 static int cleanup(void);
 
+static int dying;
+
 static void die(const char *fmt, ...)
 {
+	dying = 1;
 	handle(FALSE);
 	va_list args;
 	va_start(args, fmt);
@@ -137,10 +278,26 @@ static void die(const char *fmt, ...)
 
 #define FONT_W 8
 #define FONT_H 8
+/* the font expanded for the scales it is drawn at, see font_atlas() */
+#define FONT_MAX_SCALE 4
+static struct glyph_atlas font_atlases[FONT_MAX_SCALE + 1];
+
+/* the atlas of ss_font at scale, built the first time it is asked for.
+   NULL if scale is too large, or there is no memory for it. */
+static struct glyph_atlas *font_atlas(unsigned scale) {
+	struct glyph_atlas *a;
+	if(!scale || scale > FONT_MAX_SCALE) return 0;
+	a = &font_atlases[scale];
+	if(!a->pixels && !glyph_atlas_init(a, &ss_font, scale)) return 0;
+	return a;
+}
+
 static void init_gfx() {
 	bmp_font       = bmp4_new(128, 128);
 	memcpy(bmp_font->data, topaz_font+8, 128*128*4);
 	if(!spritesheet_init(&ss_font, bmp_font, FONT_W, FONT_H)) dprintf(2, "oops\n");
+	/* the overlays draw at twice the size */
+	font_atlas(2);
 }
 
 static int get_font_width(char letter) {
@@ -154,8 +311,15 @@ static unsigned get_font_render_length(const char* text) {
 }
 
 static void draw_font(const char* text, struct spritesheet *font, unsigned x, unsigned y, unsigned scale) {
+	struct glyph_atlas *a;
+	if(font == &ss_font && (a = font_atlas(scale))) {
+		ezsdl_draw_text(a, text, x, y);
+		return;
+	}
+	ezsdl_begin_frame();
 	for(;*text && *text != '\n';x+=scale*get_font_width(*(text++)))
 		ezsdl_draw_sprite(font, *text, x, y, scale);
+	ezsdl_end_frame();
 }
 
 #ifndef MIN
@@ -168,299 +332,2528 @@ static void draw_font(const char* text, struct spritesheet *font, unsigned x, un
 
 #define ISDIGIT(c) ((c) >= '0' && (c) <= '9')
 
-static inline unsigned get_image_pixel(int x, int y) {
-	return image_data[y * page_dims.w + x];
+/* pages whose buffer would exceed this are split into tiles, and only
+   the tiles around the viewport are rendered and kept on display. */
+#define TILE_SIZE 512
+#define TILE_MARGIN 1
+#define TILED_PAGE_BYTES (16 << 20)
+
+static int page_is_tiled(ddjvu_rect_t *dims) {
+	return (size_t) dims->w * dims->h * 4 > TILED_PAGE_BYTES;
+}
+
+static int tile_cols(ddjvu_rect_t *dims) {
+	return (dims->w + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static int tile_rows(ddjvu_rect_t *dims) {
+	return (dims->h + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/* the part of a page of size dims covered by tile */
+static void tile_rect(ddjvu_rect_t *dims, int tile, ddjvu_rect_t *r) {
+	int cols = tile_cols(dims);
+	r->x = tile % cols * TILE_SIZE;
+	r->y = tile / cols * TILE_SIZE;
+	r->w = MIN(TILE_SIZE, (int) dims->w - r->x);
+	r->h = MIN(TILE_SIZE, (int) dims->h - r->y);
+}
+
+static struct cache_entry *view_tile(struct view_slot *v, int tx, int ty) {
+	tx -= v->tx;
+	ty -= v->ty;
+	if(tx < 0 || ty < 0 || tx >= v->tw || ty >= v->th) return 0;
+	return v->tiles[ty * v->tw + tx];
+}
+
+/* what to show instead of a page that is still being decoded */
+#define PLACEHOLDER_COLOR ARGB(0xc0,0xc0,0xc0)
+
+static inline void fill_span(unsigned *dst, int n, unsigned col) {
+	if(n > 0) bmp4_fill_row(dst, n, col);
+}
+
+/* expands n pixels of row y of e, starting at column x, to dst.
+   w is the width of what e holds, the page's or the tile's. */
+static void entry_span(struct cache_entry *e, int w, int y, int x, int n, unsigned *dst) {
+	if(n <= 0) return;
+	switch(e->format) {
+	case FMT_ARGB:
+		bmp4_copy_row(dst, (unsigned*) e->data + (size_t) y * w + x, n);
+		break;
+	case FMT_PAL8:
+		bmp4_pal8_row(dst, (unsigned char*) e->data + (size_t) y * w + x, n, e->pal);
+		break;
+	case FMT_MONO:
+		bmp4_mono_row(dst, (unsigned char*) e->data + (size_t) y * ((w + 7) / 8), x, n, e->pal);
+		break;
+	}
+}
+
+/* the pixels of a whole page entry as 32 bit, to be given to
+   entry_pixels_done(). */
+static const unsigned *entry_pixels(struct cache_entry *e) {
+	unsigned *p;
+	int y;
+	if(e->format == FMT_ARGB) return e->data;
+	if(!(p = malloc((size_t) e->dims.w * e->dims.h * 4))) return 0;
+	for(y = 0; y < e->dims.h; y++)
+		entry_span(e, e->dims.w, y, 0, e->dims.w, p + (size_t) y * e->dims.w);
+	return p;
+}
+
+static void entry_pixels_done(struct cache_entry *e, const unsigned *p) {
+	if(p != e->data) free((void*) p);
+}
+
+/* like get_image_span, from the preview of the page */
+static void get_preview_span(struct view_slot *v, unsigned *dst, int py, int x, int n) {
+	static unsigned *row;
+	static int row_w;
+	struct cache_entry *e = v->preview;
+	int sy;
+	if(!e || py >= v->dims.h || x + n > v->dims.w) {
+		fill_span(dst, n, v->page < 0 ? ARGB(0,0,0) : PLACEHOLDER_COLOR);
+		return;
+	}
+	sy = (size_t) py * e->dims.h / v->dims.h;
+	if(e->format == FMT_ARGB) {
+		bmp4_stretch_row((unsigned*) e->data + (size_t) sy * e->dims.w, e->dims.w,
+				 dst, v->dims.w, x, n);
+		return;
+	}
+	if(row_w < e->dims.w) {
+		free(row);
+		if(!(row = malloc(e->dims.w * 4)))
+			die("out of memory");
+		row_w = e->dims.w;
+	}
+	entry_span(e, e->dims.w, sy, 0, e->dims.w, row);
+	bmp4_stretch_row(row, e->dims.w, dst, v->dims.w, x, n);
+}
+
+/* copies n pixels of row py of the page in slot v, starting at column x.
+   whatever is missing comes from the preview, or the placeholder. */
+static void get_image_span(struct view_slot *v, unsigned *dst, int py, int x, int n) {
+	struct cache_entry *e;
+	ddjvu_rect_t r;
+	int tx, ty, span;
+	if((e = v->whole) && py < e->dims.h && x + n <= e->dims.w) {
+		entry_span(e, e->dims.w, py, x, n, dst);
+		return;
+	}
+	if(v->zoomed && py < v->dims.h && x + n <= v->dims.w) {
+		bmp4_copy_row(dst, v->zoomed + py * v->dims.w + x, n);
+		return;
+	}
+	if(!v->tiled || py >= v->dims.h || x + n > v->dims.w) {
+		get_preview_span(v, dst, py, x, n);
+		return;
+	}
+	ty = py / TILE_SIZE;
+	for(; n > 0; dst += span, x += span, n -= span) {
+		tx = x / TILE_SIZE;
+		span = MIN(n, (tx + 1) * TILE_SIZE - x);
+		if((e = view_tile(v, tx, ty))) {
+			tile_rect(&e->dims, e->tile, &r);
+			entry_span(e, r.w, py - r.y, x - r.x, span, dst);
+		} else
+			get_preview_span(v, dst, py, x, span);
+	}
+}
+
+/* where slot i starts, relative to the top of curr_page */
+static int view_top(int i) {
+	return page_top[view[i].page] - page_top[curr_page];
+}
+
+/* where the page in slot v starts in the width of the strip */
+static int view_left(struct view_slot *v) {
+	return (layout_w - (int) v->dims.w) / 2;
+}
+
+/* copies n pixels of row y of the strip, counted from the top of
+   curr_page, starting at column x. what no page covers is black. */
+static void get_strip_span(unsigned *dst, int y, int x, int n) {
+	struct view_slot *v;
+	int i, top, left, w, a, b;
+	for(i = 0; i < view_count; i++) {
+		v = &view[i];
+		if(v->page < 0) break;
+		top = view_top(i);
+		if(y < top) break;
+		if(y >= top + layout_h(v->page)) continue;
+		/* size still unknown, the layout made room for a guess */
+		w = v->dims.w ? (int) v->dims.w : layout_w;
+		left = (layout_w - w) / 2;
+		a = MAX(x, left);
+		b = MIN(x + n, left + w);
+		if(a >= b) break;
+		fill_span(dst, a - x, ARGB(0,0,0));
+		if(v->dims.w) get_image_span(v, dst + a - x, y - top, a - left, b - a);
+		else fill_span(dst + a - x, b - a, PLACEHOLDER_COLOR);
+		fill_span(dst + b - x, x + n - b, ARGB(0,0,0));
+		return;
+	}
+	fill_span(dst, n, ARGB(0,0,0));
+}
+
+static void thumb_dims(int pageno, ddjvu_rect_t *r);
+
+static int overview_cols(void) {
+	return MAX(((int) ezsdl_get_width() - THUMB_GAP) / CELL_W, 1);
+}
+
+/* where the grid starts, it is centered in the window */
+static int overview_left(void) {
+	return MAX(((int) ezsdl_get_width() - overview_cols() * CELL_W + THUMB_GAP) / 2, 0);
+}
+
+#define OVERVIEW_BG ARGB(0x40,0x40,0x40)
+#define OVERVIEW_SEL ARGB(0xff,0x00,0x00)
+
+/* fills the part of the given rectangle that is on screen */
+static void fill_box(unsigned *vram, unsigned pitch, int x, int y, int w, int h, unsigned col) {
+	int sw = ezsdl_get_width(), sh = ezsdl_get_height();
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	w = MIN(w, sw - x);
+	for(h = MIN(y + h, sh); y < h; y++)
+		fill_span(vram + y * pitch + x, w, col);
+}
+
+static void overview_draw(void) {
+	int cols = overview_cols(), left = overview_left();
+	int w = ezsdl_get_width(), h = ezsdl_get_height(), sel = THUMB_GAP / 4;
+	int i, x, y, n, top, ty;
+	void *pixels;
+	unsigned *vram, pitch;
+	ddjvu_rect_t r;
+	ezsdl_get_vram_and_pitch(&pixels, &pitch);
+	vram = pixels;
+	pitch /= 4;
+	fill_box(vram, pitch, 0, 0, w, h, OVERVIEW_BG);
+	for(i = overview_y / CELL_H * cols; i < page_count; i++) {
+		struct cache_entry *e = thumbs[i];
+		top = THUMB_GAP + (long long) i / cols * CELL_H - overview_y;
+		if(top >= h) break;
+		if(e) r = e->dims;
+		else thumb_dims(i, &r);
+		x = left + i % cols * CELL_W + (THUMB_W - (int) r.w) / 2;
+		y = top + (THUMB_H - (int) r.h) / 2;
+		if(i == overview_sel)
+			fill_box(vram, pitch, x - sel, y - sel, r.w + 2 * sel, r.h + 2 * sel, OVERVIEW_SEL);
+		if(!e) {
+			fill_box(vram, pitch, x, y, r.w, r.h, PLACEHOLDER_COLOR);
+			continue;
+		}
+		if((n = MIN((int) r.w, w - x)) <= 0) continue;
+		for(ty = MAX(-y, 0); ty < (int) r.h && y + ty < h; ty++)
+			entry_span(e, r.w, ty, 0, n, vram + (y + ty) * pitch + x);
+	}
+	ezsdl_release_vram();
+}
+
+/* draw() only paints the rows that scrolled into view, as long as what
+   it drew last is still on screen and nothing but the vertical offset
+   changed since. whatever else draws to the screen sets screen_stale.
+   SDL2 hands out texture memory write-only, it need not hold the last
+   frame, so there every frame is painted whole. */
+static int screen_stale = 1;
+static unsigned long long drawn_stamp;
+static long long drawn_y;
+
+/* a hash of everything draw() depends on, besides the vertical offset */
+static unsigned long long view_stamp(void) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	int i, j;
+#define STAMP(V) (h = (h ^ (unsigned long long) (V)) * 0x100000001b3ULL)
+	STAMP(layout_gen);
+	STAMP(layout_w);
+	STAMP(scroll_line_h);
+	STAMP(ezsdl_get_epoch());
+	STAMP(view_count);
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		STAMP(v->page);
+		STAMP(v->dims.w);
+		STAMP(v->dims.h);
+		STAMP(v->whole ? v->whole->serial : 0);
+		STAMP(v->preview ? v->preview->serial : 0);
+		STAMP(v->zoomed ? v->zoomed_serial : 0);
+		STAMP(v->tx);
+		STAMP(v->ty);
+		STAMP(v->tw);
+		STAMP(v->th);
+		for(j = 0; j < v->tw * v->th; j++)
+			STAMP(v->tiles[j] ? v->tiles[j]->serial : 0);
+	}
+#undef STAMP
+	return h;
+}
+
+static void draw() {
+	int y, ymin = 0, ymax = ezsdl_get_height();
+	void *pixels;
+	unsigned *ptr;
+	unsigned pitch;
+	int xoff = MAX((int)(ezsdl_get_width() - layout_w)/2, 0);
+	int xmax = MIN(ezsdl_get_width(), layout_w - scroll_line_h);
+	long long top = page_top[curr_page] + scroll_line_v, dy = top - drawn_y;
+	unsigned long long stamp;
+	if(overview) {
+		overview_draw();
+		screen_stale = 1;
+		return;
+	}
+	if(xmax <= 0) return;
+#ifdef USE_SDL2
+	screen_stale = 1;
+#endif
+	stamp = view_stamp();
+	if(!screen_stale && stamp == drawn_stamp && dy < ymax && -dy < ymax) {
+		/* move what is still in view, paint the rest */
+		ezsdl_scroll_vram(dy);
+		if(dy >= 0) ymin = ymax - dy;
+		else ymax = -dy;
+	}
+	screen_stale = 0;
+	drawn_stamp = stamp;
+	drawn_y = top;
+	if(ymin >= ymax) return;
+	ezsdl_get_vram_and_pitch(&pixels, &pitch);
+	ptr = pixels;
+	pitch/=4;
+	for(y = ymin; y < ymax; y++)
+		get_strip_span(ptr + y*pitch + xoff, y+scroll_line_v, scroll_line_h, xmax);
+	ezsdl_release_vram();
+}
+
+static void draw_borders() {
+	int x, y, yline, xoff = MAX((int)(ezsdl_get_width() - layout_w)/2, 0);
+	int ymax = ezsdl_get_height();
+	if (!xoff || overview) return;
+	void* pixels;
+	unsigned *vram, *ptr;
+	unsigned pitch;
+	ezsdl_get_vram_and_pitch(&pixels, &pitch);
+	vram = pixels;
+	pitch /= 4;
+	for(y = 0, yline = 0; y < ymax; y++, yline+=pitch)
+		for(x = 0, ptr=vram+yline; x < xoff; x++, ptr++)
+			*ptr = ARGB(0,0,0);
+	for(y = 0, yline = 0; y < ymax; y++, yline+=pitch)
+		for(x = 0, ptr=vram+yline+xoff+layout_w; x < xoff; x++, ptr++)
+			*ptr = ARGB(0,0,0);
+	ezsdl_release_vram();
+}
+
+#ifdef USE_SDL2
+/* with SDL2 every page and tile on display is uploaded to a static
+   texture of its own, once, and the renderer composites the frame from
+   them. scrolling and panning then only change where they are drawn.
+   a texture is known by the serial of what it holds, and dropped once
+   that left the display. UI thread only. */
+static struct page_tex {
+	unsigned long serial, frame;
+	SDL_Texture *tex;
+} *texs;
+static int ntexs, texs_cap;
+static unsigned long tex_frame;
+static unsigned tex_epoch;
+
+static SDL_Texture *tex_find(unsigned long serial) {
+	int i;
+	for(i = 0; i < ntexs; i++)
+		if(texs[i].serial == serial) {
+			texs[i].frame = tex_frame;
+			return texs[i].tex;
+		}
+	return 0;
+}
+
+static SDL_Texture *tex_add(unsigned long serial, const unsigned *p, int w, int h) {
+	struct page_tex *grown;
+	SDL_Texture *t;
+	if(ntexs == texs_cap) {
+		if(!(grown = realloc(texs, (texs_cap + 64) * sizeof *texs))) return 0;
+		texs = grown;
+		texs_cap += 64;
+	}
+	if(!(t = ezsdl_new_texture(p, w, h, w * 4))) return 0;
+	texs[ntexs].serial = serial;
+	texs[ntexs].frame = tex_frame;
+	texs[ntexs++].tex = t;
+	return t;
+}
+
+/* the texture of the page or tile e */
+static SDL_Texture *tex_entry(struct cache_entry *e) {
+	SDL_Texture *t;
+	ddjvu_rect_t r = e->dims;
+	unsigned *buf;
+	int y;
+	if((t = tex_find(e->serial))) return t;
+	if(e->tile >= 0) tile_rect(&e->dims, e->tile, &r);
+	if(e->format == FMT_ARGB) return tex_add(e->serial, e->data, r.w, r.h);
+	if(!(buf = malloc((size_t) r.w * r.h * 4))) return 0;
+	for(y = 0; y < r.h; y++)
+		entry_span(e, r.w, y, 0, r.w, buf + (size_t) y * r.w);
+	t = tex_add(e->serial, buf, r.w, r.h);
+	free(buf);
+	return t;
+}
+
+/* drops the textures of what is not on display anymore */
+static void tex_sweep(void) {
+	int i, j;
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->whole) tex_find(v->whole->serial);
+		if(v->preview) tex_find(v->preview->serial);
+		if(v->zoomed) tex_find(v->zoomed_serial);
+		for(j = 0; j < v->tw * v->th; j++)
+			if(v->tiles[j]) tex_find(v->tiles[j]->serial);
+	}
+	for(i = 0; i < ntexs; )
+		if(texs[i].frame != tex_frame) {
+			ezsdl_free_texture(texs[i].tex);
+			texs[i] = texs[--ntexs];
+		} else i++;
+}
+
+/* draws the page in slot v at x, y of the window, like get_image_span() */
+static int tex_page(struct view_slot *v, int x, int y) {
+	struct cache_entry *e;
+	SDL_Texture *t;
+	ddjvu_rect_t r;
+	int i, sw = ezsdl_get_width(), sh = ezsdl_get_height();
+	if((e = v->whole)) {
+		if(!(t = tex_entry(e))) return 0;
+		ezsdl_draw_texture(t, 0, 0, e->dims.w, e->dims.h, x, y, e->dims.w, e->dims.h);
+		return 1;
+	}
+	if(v->zoomed) {
+		if(!(t = tex_find(v->zoomed_serial)) &&
+		   !(t = tex_add(v->zoomed_serial, v->zoomed, v->dims.w, v->dims.h)))
+			return 0;
+		ezsdl_draw_texture(t, 0, 0, v->dims.w, v->dims.h, x, y, v->dims.w, v->dims.h);
+		return 1;
+	}
+	if((e = v->preview)) {
+		if(!(t = tex_entry(e))) return 0;
+		ezsdl_draw_texture(t, 0, 0, e->dims.w, e->dims.h, x, y, v->dims.w, v->dims.h);
+	} else
+		ezsdl_fill_region(x, y, v->dims.w, v->dims.h, PLACEHOLDER_COLOR);
+	for(i = 0; i < v->tw * v->th; i++) {
+		if(!(e = v->tiles[i])) continue;
+		tile_rect(&e->dims, e->tile, &r);
+		/* the margin is only uploaded once it scrolls into view */
+		if(x + r.x >= sw || y + r.y >= sh || x + r.x + (int) r.w <= 0 || y + r.y + (int) r.h <= 0)
+			continue;
+		if(!(t = tex_entry(e))) return 0;
+		ezsdl_draw_texture(t, 0, 0, r.w, r.h, x + r.x, y + r.y, r.w, r.h);
+	}
+	return 1;
+}
+
+/* composites the window with the renderer. returns 0 if something could
+   not be made a texture, or the overview is on: draw() does it on the
+   CPU then. */
+static int draw_tex(void) {
+	int w = ezsdl_get_width(), h = ezsdl_get_height();
+	int xoff = MAX((w - layout_w) / 2, 0) - scroll_line_h;
+	int i, y, ph;
+	if(overview) return 0;
+	/* the renderer was made anew, and took the textures with it */
+	if(ezsdl_get_epoch() != tex_epoch) {
+		ntexs = 0;
+		tex_epoch = ezsdl_get_epoch();
+	}
+	tex_frame++;
+	ezsdl_fill_region(0, 0, w, h, ARGB(0,0,0));
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0) break;
+		y = view_top(i) - scroll_line_v;
+		ph = layout_h(v->page);
+		if(y >= h) break;
+		if(y + ph <= 0) continue;
+		if(!v->dims.w)
+			ezsdl_fill_region(xoff, y, layout_w, ph, PLACEHOLDER_COLOR);
+		else if(!tex_page(v, xoff + view_left(v), y))
+			return 0;
+	}
+	tex_sweep();
+	return 1;
+}
+#endif
+
+static int game_tick(int need_redraw) {
+	long long ms_used = 0;
+	if(need_redraw) {
+		long long tstamp = ezsdl_getutime64();
+#ifdef USE_SDL2
+		if(draw_tex()) {
+			ezsdl_present();
+			/* the streaming texture did not get this frame */
+			screen_stale = 1;
+		} else
+#endif
+		{
+			ezsdl_begin_frame();
+			draw();
+#ifdef USE_SDL2
+			/* frames made from textures left the borders out */
+			need_redraw |= 2;
+#endif
+			if(need_redraw & 2) draw_borders();
+			ezsdl_end_frame();
+			ezsdl_refresh();
+		}
+		ms_used = ezsdl_getutime64() - tstamp;
+	}
+	long sleepms = 1000/fps - ms_used;
+	if(sleepms >= 0) ezsdl_sleep(sleepms);
+
+	tickcounter++;
+	return 0;
+}
+
+/* channel masks of the display, pages are rendered straight into them */
+static unsigned pixel_masks[4];
+
+static void prepare_rect(ddjvu_rect_t *prect, ddjvu_rect_t* desired_rect,
+			double iw, double ih, int dpi, int scale)
+{
+	int enforce_aspect_ratio = 1;
+
+	prect->x = 0;
+	prect->y = 0;
+	if (desired_rect) {
+		prect->w = desired_rect->w;
+		prect->h = desired_rect->h;
+		enforce_aspect_ratio = 0;
+	} else if (scale > 0) {
+		prect->w = (unsigned int) (iw * (double)scale) / dpi;
+		prect->h = (unsigned int) (ih * (double)scale) / dpi;
+	} else {
+		prect->w = (iw * 100) / dpi;
+		prect->h = (ih * 100) / dpi;
+	}
+	if (enforce_aspect_ratio) {
+		double dw = iw / prect->w;
+		double dh = ih / prect->h;
+		if (dw > dh)
+			prect->h = (int)(ih / dw);
+		else
+			prect->w = (int)(iw / dh);
+	}
+}
+
+/* serializes all access to the djvu backend and to the mupdf document,
+   which are shared between the UI thread and the render workers. */
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the mupdf pages rendered last, with their display lists, so rendering
+   a page again at another scale, or tile by tile, only replays its list
+   instead of interpreting the page anew. protected by backend_lock. */
+#define MAX_DLISTS 32
+static struct dlist {
+	fz_page *page;
+	fz_display_list *list;
+	fz_rect bounds;
+	int pageno;
+	unsigned long used;
+} dlists[MAX_DLISTS];
+static unsigned long dlist_clock;
+
+static void pdf_drop_list(fz_context *ctx, struct dlist *d) {
+	if(d->list) fz_drop_display_list(ctx, d->list);
+	if(d->page) fz_drop_page(ctx, d->page);
+	d->list = 0;
+	d->page = 0;
+}
+
+/* caller holds backend_lock. returns a reference to the display list of
+   pageno, to be dropped by the caller, or NULL if the page can't be
+   loaded. */
+static fz_display_list *pdf_get_list(fz_context *ctx, int pageno, fz_rect *bounds) {
+	struct dlist *d, *lru = dlists;
+	for(d = dlists; d < dlists + MAX_DLISTS; d++) {
+		if(d->list && d->pageno == pageno) break;
+		if(!lru->list) continue;
+		if(!d->list || d->used < lru->used) lru = d;
+	}
+	if(d == dlists + MAX_DLISTS) {
+		d = lru;
+		pdf_drop_list(ctx, d);
+		fz_try(ctx) {
+			d->page = fz_load_page(ctx, PDOC.doc, pageno);
+			d->bounds = fz_bound_page(ctx, d->page);
+			d->list = fz_new_display_list_from_page(ctx, d->page);
+		}
+		fz_catch(ctx) {
+			fprintf(stderr, "failed to load page %d\n", pageno);
+			pdf_drop_list(ctx, d);
+			return 0;
+		}
+		d->pageno = pageno;
+	}
+	d->used = ++dlist_clock;
+	*bounds = d->bounds;
+	return fz_keep_display_list(ctx, d->list);
+}
+
+/* runs on any thread; ctx is that thread's own clone of PDOC.ctx.
+   the document is only touched under backend_lock to get the page's
+   display list, the rasterisation itself runs in parallel.
+   if tile is not -1 only that part of the page is rendered, res_rect
+   receives the size of the whole page either way. the render gives up
+   half way, returning NULL, once cookie->abort is set. */
+static unsigned* render_pdf_page(fz_context *ctx, int pageno, int scale, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect, int tile,
+				 fz_cookie *cookie)
+{
+	ddjvu_rect_t prect, rrect;
+	/* mupdf platform/x11/pdfapp.c */
+	fz_display_list *list;
+	fz_rect bounds;
+	pthread_mutex_lock(&backend_lock);
+	list = pdf_get_list(ctx, pageno, &bounds);
+	pthread_mutex_unlock(&backend_lock);
+	if(!list) {
+		page_set_broken(pageno);
+		return NULL;
+	}
+
+	double iw = bounds.x1 - bounds.x0;
+	double ih = bounds.y1 - bounds.y0;
+	int dpi = 72;
+
+	prepare_rect(&prect, desired_rect, iw, ih, dpi, scale);
+	rrect = prect;
+	if(tile >= 0) tile_rect(&prect, tile, &rrect);
+
+	unsigned *image;
+	if(!(image = malloc(4 * rrect.w * rrect.h)))
+		die("Cannot allocate image buffer for page %d", pageno);
+
+	fz_matrix ctm;
+	fz_pixmap *pix = 0;
+	fz_device *dev = 0;
+	/* with alpha the samples are 32 bit, in memory order either RGBA
+	   or BGRA, so pick the one that matches the display. */
+	fz_colorspace *cs = pixel_masks[0] == 0xff ? fz_device_rgb(ctx) : fz_device_bgr(ctx);
+	int failed = 0;
+
+	/* let mupdf draw right into the page buffer. it starts out opaque
+	   white, so the result needs no blending afterwards. the pixmap
+	   sits at the tile's place on the page, which clips the drawing,
+	   and the tile is the scissor, so the list skips what lies outside. */
+	fz_irect bbox = { rrect.x, rrect.y, rrect.x + rrect.w, rrect.y + rrect.h };
+	ctm = fz_scale((double) prect.w / iw, (double) prect.h / ih);
+	fz_try(ctx) {
+		pix = fz_new_pixmap_with_bbox_and_data(ctx, cs, bbox, 0, 1, (unsigned char*) image);
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+		dev = fz_new_draw_device(ctx, fz_identity, pix);
+		fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(bbox), cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx) {
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_display_list(ctx, list);
+	}
+	fz_catch(ctx)
+		failed = 1;
+
+	if (failed || (cookie && cookie->abort)) {
+		free(image);
+		return NULL;
+	}
+
+	*res_rect = prect;
+	return image;
+}
+
+
+static unsigned* render_page(ddjvu_page_t *page, int pageno, int scale, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect, int tile)
+{
+	ddjvu_rect_t prect; // pixels of image
+	ddjvu_rect_t rrect; // pixels of segment (info_segment)
+	ddjvu_render_mode_t mode;
+	ddjvu_format_t *fmt;
+	int iw = ddjvu_page_get_width(page);
+	int ih = ddjvu_page_get_height(page);
+	int dpi = ddjvu_page_get_resolution(page);
+	ddjvu_page_type_t type = ddjvu_page_get_type(page);
+	unsigned *image = 0;
+	int rowsize;
+
+	prepare_rect(&prect, desired_rect, iw, ih, dpi, scale);
+
+	rrect = prect;
+	if(tile >= 0) tile_rect(&prect, tile, &rrect);
+#if 0
+	// show only section/segment of rendered image
+	if (segment_given > 0) {
+		rrect = segment_rect;
+		if (rrect.x < 0)
+			rrect.x = prect.w - rrect.w + rrect.x;
+		if (rrect.y < 0)
+			rrect.y = prect.h - rrect.h + rrect.y;
+	}
+#endif
+
+	mode = DDJVU_RENDER_COLOR;
+
+	/* always 32 bit, cache_pack() makes it smaller afterwards */
+	if (!(fmt = ddjvu_format_create(DDJVU_FORMAT_RGBMASK32, 4, pixel_masks)))
+		die("Cannot determine pixel style for page %d", pageno);
+
+	ddjvu_format_set_row_order(fmt, 1);
+
+	rowsize = rrect.w * 4;
+	if(!(image = malloc(rowsize * rrect.h)))
+		die("Cannot allocate image buffer for page %d", pageno);
+
+	/* fill image with white in case rendering fails */
+	if(!ddjvu_page_render(page, mode, &prect, &rrect, fmt, rowsize, (char*) image))
+		memset(image, 0xFF, rowsize * rrect.h);
+
+	ddjvu_format_release(fmt);
+	*res_rect = prect;
+	return image;
+}
+
+static ddjvu_page_t *djvu_decode_get(int pageno);
+static void djvu_decode_put(ddjvu_page_t *page);
+
+static unsigned* prep_djvu_page(int pageno, int scale, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect, int tile)
+{
+	ddjvu_page_t *page = djvu_decode_get(pageno);
+	unsigned *image = render_page(page, pageno, scale, res_rect, desired_rect, tile);
+	djvu_decode_put(page);
+	return image;
+}
+
+/* the thumbnail of a djvu page from djvulibre, resampled to the size
+   asked for, or NULL if djvulibre has yet to make it. caller holds
+   backend_lock. */
+static unsigned* prep_djvu_thumb(int pageno, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect)
+{
+	ddjvu_format_t *fmt;
+	int w = desired_rect->w, h = desired_rect->h, y, ok = 0;
+	unsigned *thumb, *image;
+	/* not done yet: the overview draws its placeholder until it is */
+	if (ddjvu_thumbnail_status(DDOC.doc, pageno, FALSE) < DDJVU_JOB_OK)
+		return 0;
+	if (!(fmt = ddjvu_format_create(DDJVU_FORMAT_RGBMASK32, 4, pixel_masks)))
+		die("Cannot determine pixel style for page %d", pageno);
+	ddjvu_format_set_row_order(fmt, 1);
+	if(!(thumb = malloc(4 * w * h)) || !(image = malloc(4 * w * h)))
+		die("Cannot allocate image buffer for page %d", pageno);
+	/* w and h come back as the size it has, which keeps the aspect
+	   of the page and might be a bit smaller. */
+	if(ddjvu_thumbnail_render(DDOC.doc, pageno, &w, &h, fmt, 4 * desired_rect->w, (char*) thumb) &&
+	   w > 0 && h > 0) {
+		for(y = 1; y < h; y++)
+			memmove(thumb + y * w, thumb + y * desired_rect->w, 4 * w);
+		ok = bmp4_resample(thumb, w, h, image, desired_rect->w, desired_rect->h);
+	}
+	if(!ok)
+		memset(image, 0xFF, 4 * desired_rect->w * desired_rect->h);
+	free(thumb);
+	ddjvu_format_release(fmt);
+	*res_rect = *desired_rect;
+	return image;
+}
+
+/* ctx is the mupdf context of the calling thread, unused for djvu.
+   cookie may be NULL, it is only used for mupdf. */
+static unsigned* prep_page(fz_context *ctx, int pageno, int scale, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect, int tile,
+			   fz_cookie *cookie)
+{
+	if(pageno >= page_count) return 0;
+	if(!IS_DJVU)
+		return render_pdf_page(ctx, pageno, scale, res_rect, desired_rect, tile, cookie);
+	pthread_mutex_lock(&backend_lock);
+	unsigned *image = scale == THUMB_SCALE ?
+		prep_djvu_thumb(pageno, res_rect, desired_rect) :
+		prep_djvu_page(pageno, scale, res_rect, desired_rect, tile);
+	pthread_mutex_unlock(&backend_lock);
+	return image;
+}
+
+static int job_aborted(fz_cookie *cookie);
+
+/* renders a page the djvu decoder already finished. a whole page asked
+   for before its size was known is left alone if it turns out too large
+   for a single buffer, the UI thread switches it to tiles. ddjvu_page_render
+   can't be interrupted, so a job cancelled while waiting for the backend
+   is dropped before it starts. */
+static unsigned* prep_decoded_page(ddjvu_page_t *page, int pageno, int scale, ddjvu_rect_t *res_rect,
+				   ddjvu_rect_t *desired_rect, int tile, fz_cookie *cookie) {
+	unsigned *data = 0;
+	ddjvu_rect_t prect;
+	pthread_mutex_lock(&backend_lock);
+	if(job_aborted(cookie)) {
+		pthread_mutex_unlock(&backend_lock);
+		return 0;
+	}
+	prepare_rect(&prect, desired_rect, ddjvu_page_get_width(page), ddjvu_page_get_height(page),
+		     ddjvu_page_get_resolution(page), scale);
+	if(tile >= 0 || !page_is_tiled(&prect))
+		data = render_page(page, pageno, scale, res_rect, desired_rect, tile);
+	pthread_mutex_unlock(&backend_lock);
+	return data;
+}
+
+/* rendered pages and tiles are kept in a byte-budgeted LRU cache keyed by
+   (page, scale, tile). the entries on display are borrowed and never
+   evicted. what falls out of it is run-length compressed into a second
+   tier with a budget of its own, which is a lot cheaper to bring back
+   than rendering the page again. */
+
+/* most recently used first */
+struct cache_list {
+	struct cache_entry *head, *tail;
+};
+
+static struct page_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct cache_list lru;
+	size_t used, budget;
+	/* the compressed tier. zraw is what its entries take unpacked */
+	struct cache_list zlru;
+	size_t zused, zraw, zbudget;
+	/* evicted entries waiting to be compressed by cache_unlock() */
+	struct cache_entry *pending;
+	/* bumped whenever a page is added */
+	unsigned long generation;
+	/* the last serial handed out */
+	unsigned long serial;
+	/* a miss is counted for every page that had to be rendered or
+	   unzipped, not per lookup: the window is polled repeatedly */
+	unsigned long hits, misses, evictions, zhits;
+	/* pages found in and written to the disk cache */
+	unsigned long dhits, dstores;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void cache_unlink(struct cache_list *l, struct cache_entry *e) {
+	if(e->prev) e->prev->next = e->next;
+	else l->head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else l->tail = e->prev;
+	e->prev = e->next = 0;
+}
+
+static void cache_push_front(struct cache_list *l, struct cache_entry *e) {
+	e->prev = 0;
+	e->next = l->head;
+	if(l->head) l->head->prev = e;
+	l->head = e;
+	if(!l->tail) l->tail = e;
+}
+
+static void entry_free_data(struct cache_entry *e) {
+	if(e->map) munmap(e->map, e->map_len);
+	else free(e->data);
+	e->data = e->map = 0;
+}
+
+static void cache_free_entry(struct cache_entry *e) {
+	entry_free_data(e);
+	free(e->pal);
+	free(e);
+}
+
+/* stores the w x h pixels of data in e, in the smallest format that
+   keeps them all: two colours take a bit per pixel, up to 256 a byte,
+   anything else stays 32 bit. pages are rendered 32 bit all the same,
+   so this only saves memory from here on. takes ownership of data. */
+static void cache_pack(struct cache_entry *e, unsigned *data, int w, int h) {
+	/* colour -> palette index + 1, open addressing */
+	unsigned keys[1024], vals[1024], pal[256];
+	size_t i, n = (size_t) w * h;
+	unsigned char *idx, *bits;
+	unsigned last = 0, last_idx = 0;
+	int npal = 0, x, y;
+
+	e->data = data;
+	e->format = FMT_ARGB;
+	e->size = n * 4;
+	if(!n || !(idx = malloc(n))) return;
+	memset(vals, 0, sizeof vals);
+	for(i = 0; i < n; i++) {
+		unsigned c = data[i], slot;
+		/* runs of the same colour are the rule */
+		if(i && c == last) {
+			idx[i] = last_idx;
+			continue;
+		}
+		for(slot = (c * 2654435761u) >> 22; vals[slot] && keys[slot] != c; slot = (slot + 1) & 1023);
+		if(!vals[slot]) {
+			if(npal == 256) {
+				free(idx);
+				return;
+			}
+			keys[slot] = c;
+			vals[slot] = ++npal;
+			pal[npal - 1] = c;
+		}
+		idx[i] = last_idx = vals[slot] - 1;
+		last = c;
+	}
+	/* without memory for the palette it stays as it is */
+	if(!(e->pal = malloc(MAX(npal, 2) * sizeof *pal))) {
+		free(idx);
+		return;
+	}
+	free(data);
+	memcpy(e->pal, pal, npal * sizeof *pal);
+	if(npal == 1) e->pal[1] = pal[0];
+	e->npal = npal;
+	if(npal > 2) {
+		e->data = idx;
+		e->format = FMT_PAL8;
+		e->size = n + npal * sizeof *pal;
+		return;
+	}
+	/* the bits of a row never overtake its bytes, so pack in place */
+	bits = idx;
+	for(y = 0; y < h; y++) {
+		const unsigned char *src = idx + (size_t) y * w;
+		unsigned char *dst = bits + (size_t) y * ((w + 7) / 8);
+		for(x = 0; x < w; x += 8) {
+			unsigned char b = 0;
+			int k;
+			for(k = 0; k < 8 && x + k < w; k++)
+				b |= src[x + k] << (7 - k);
+			dst[x / 8] = b;
+		}
+	}
+	n = (size_t) h * ((w + 7) / 8);
+	if(!(e->data = realloc(idx, n))) e->data = idx;
+	e->format = FMT_MONO;
+	e->size = n + npal * sizeof *pal;
+}
+
+static struct cache_entry *cache_lookup(struct cache_list *l, int pageno, int scale,
+					ddjvu_rect_t *forced, int tile) {
+	struct cache_entry *e;
+	for(e = l->head; e; e = e->next)
+		if(e->page == pageno && e->scale == scale && e->tile == tile &&
+		   (forced ? e->forced && e->dims.w == forced->w && e->dims.h == forced->h : !e->forced))
+			return e;
+	return 0;
+}
+
+/* caller holds cache.lock. forced selects a page rendered to that
+   size instead of its natural one. */
+static struct cache_entry *cache_find(int pageno, int scale, ddjvu_rect_t *forced, int tile) {
+	return cache_lookup(&cache.lru, pageno, scale, forced, tile);
+}
+
+/* caller holds cache.lock. the evicted entries are handed to
+   cache_unlock() for the compressed tier. */
+static void cache_evict(size_t needed) {
+	struct cache_entry *e = cache.lru.tail, *prev;
+	while(e && cache.used + needed > cache.budget) {
+		prev = e->prev;
+		if(!e->refs) {
+			cache_unlink(&cache.lru, e);
+			cache.used -= e->size;
+			cache.evictions++;
+			if(cache.zbudget) {
+				e->next = cache.pending;
+				cache.pending = e;
+			} else
+				cache_free_entry(e);
+		}
+		e = prev;
+	}
+}
+
+/* bytes of pixel data in e, without the palette, and the unit runs are
+   made of */
+static size_t entry_data_size(struct cache_entry *e, int *unit) {
+	ddjvu_rect_t r = e->dims;
+	if(e->tile >= 0) tile_rect(&e->dims, e->tile, &r);
+	*unit = e->format == FMT_ARGB ? 4 : 1;
+	switch(e->format) {
+	case FMT_ARGB: return (size_t) r.w * r.h * 4;
+	case FMT_PAL8: return (size_t) r.w * r.h;
+	default: return (size_t) r.h * ((r.w + 7) / 8);
+	}
+}
+
+static int rle_same(const unsigned char *p, size_t a, size_t b, int unit) {
+	if(unit == 4) return ((const unsigned*) p)[a] == ((const unsigned*) p)[b];
+	return p[a] == p[b];
+}
+
+static unsigned char *rle_literals(unsigned char *out, const unsigned char *src, size_t n, int unit) {
+	while(n) {
+		size_t len = MIN(n, 128);
+		*out++ = len - 1;
+		memcpy(out, src, len * unit);
+		out += len * unit;
+		src += len * unit;
+		n -= len;
+	}
+	return out;
+}
+
+/* packbits on units of 1 or 4 bytes: a control byte below 0x80 is
+   followed by that many plus one literal units, else by a single unit
+   repeated c - 0x80 + 2 times. dst needs room for
+   n * unit + n / 128 + 1 bytes. returns the bytes written. */
+static size_t rle_encode(const unsigned char *src, size_t n, int unit, unsigned char *dst) {
+	unsigned char *out = dst;
+	size_t i = 0, lit = 0, r;
+	size_t minrun = unit == 1 ? 3 : 2;
+	while(i < n) {
+		for(r = 1; i + r < n && r < 129 && rle_same(src, i, i + r, unit); r++);
+		if(r < minrun) {
+			i++;
+			continue;
+		}
+		out = rle_literals(out, src + lit * unit, i - lit, unit);
+		*out++ = 0x80 + r - 2;
+		memcpy(out, src + i * unit, unit);
+		out += unit;
+		lit = i += r;
+	}
+	out = rle_literals(out, src + lit * unit, n - lit, unit);
+	return out - dst;
+}
+
+static void rle_decode(const unsigned char *src, unsigned char *dst, size_t n, int unit) {
+	unsigned char *end = dst + n * unit;
+	size_t len;
+	unsigned v, *p;
+	while(dst < end) {
+		unsigned c = *src++;
+		if(c < 0x80) {
+			len = (c + 1) * unit;
+			memcpy(dst, src, len);
+			src += len;
+			dst += len;
+			continue;
+		}
+		len = c - 0x80 + 2;
+		if(unit == 1)
+			memset(dst, *src, len);
+		else for(memcpy(&v, src, 4), p = (unsigned*) dst; p < (unsigned*) dst + len; p++)
+			*p = v;
+		src += unit;
+		dst += len * unit;
+	}
+}
+
+/* compresses the data of an evicted entry. returns 0 if that does not
+   pay off. */
+static int cache_zip(struct cache_entry *e) {
+	int unit;
+	size_t raw = entry_data_size(e, &unit), n = raw / unit, zsize;
+	unsigned char *z, *shrunk;
+	if(!(z = malloc(raw + n / 128 + 1))) return 0;
+	zsize = rle_encode(e->data, n, unit, z);
+	if(zsize >= raw / 2) {
+		free(z);
+		return 0;
+	}
+	if((shrunk = realloc(z, zsize))) z = shrunk;
+	entry_free_data(e);
+	e->data = z;
+	e->zsize = zsize;
+	e->size = e->size - raw + zsize;
+	return 1;
+}
+
+/* caller holds cache.lock */
+static void cache_zevict(void) {
+	struct cache_entry *e;
+	int unit;
+	while(cache.zused > cache.zbudget && (e = cache.zlru.tail)) {
+		cache_unlink(&cache.zlru, e);
+		cache.zused -= e->size;
+		cache.zraw -= e->size - e->zsize + entry_data_size(e, &unit);
+		cache_free_entry(e);
+	}
+}
+
+/* releases cache.lock, after moving what was evicted while holding it
+   to the compressed tier. the compression itself runs unlocked. */
+static void cache_unlock(void) {
+	struct cache_entry *e;
+	int unit;
+	while((e = cache.pending)) {
+		int zipped;
+		cache.pending = e->next;
+		e->next = 0;
+		pthread_mutex_unlock(&cache.lock);
+		zipped = cache_zip(e);
+		pthread_mutex_lock(&cache.lock);
+		/* it might have been rendered again meanwhile */
+		if(!zipped || cache_find(e->page, e->scale, e->forced ? &e->dims : 0, e->tile)) {
+			cache_free_entry(e);
+			continue;
+		}
+		cache_push_front(&cache.zlru, e);
+		cache.zused += e->size;
+		cache.zraw += e->size - e->zsize + entry_data_size(e, &unit);
+		cache_zevict();
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* caller holds cache.lock, which is dropped meanwhile. moves the entry
+   for (pageno, scale, tile) from the compressed tier back into the
+   cache and returns it, NULL if it is not there. */
+static struct cache_entry *cache_unzip(int pageno, int scale, ddjvu_rect_t *forced, int tile) {
+	struct cache_entry *e, *old;
+	unsigned char *data;
+	size_t raw;
+	int unit;
+	if(!(e = cache_lookup(&cache.zlru, pageno, scale, forced, tile)))
+		return 0;
+	raw = entry_data_size(e, &unit);
+	cache_unlink(&cache.zlru, e);
+	cache.zused -= e->size;
+	cache.zraw -= e->size - e->zsize + raw;
+	pthread_mutex_unlock(&cache.lock);
+	if((data = malloc(raw))) {
+		rle_decode(e->data, data, raw / unit, unit);
+		entry_free_data(e);
+		e->data = data;
+		e->size = e->size - e->zsize + raw;
+		e->zsize = 0;
+	}
+	pthread_mutex_lock(&cache.lock);
+	if(!data || (old = cache_find(pageno, scale, forced, tile))) {
+		cache_free_entry(e);
+		return data ? old : 0;
+	}
+	cache_evict(e->size);
+	cache.used += e->size;
+	cache.generation++;
+	cache.zhits++;
+	cache.misses++;
+	cache_push_front(&cache.lru, e);
+	return e;
+}
+
+/* adds e to the cache, unless someone else was faster. returns the
+   cached entry, borrowed if borrow is set. */
+static struct cache_entry *cache_add(struct cache_entry *e, int borrow) {
+	struct cache_entry *old;
+	pthread_mutex_lock(&cache.lock);
+	if((old = cache_find(e->page, e->scale, e->forced ? &e->dims : 0, e->tile))) {
+		cache_free_entry(e);
+		e = old;
+		cache_unlink(&cache.lru, e);
+	} else {
+		cache_evict(e->size);
+		cache.used += e->size;
+		cache.generation++;
+		e->serial = ++cache.serial;
+		if(e->map) cache.dhits++;
+		else cache.misses++;
+	}
+	cache_push_front(&cache.lru, e);
+	if(borrow) e->refs++;
+	cache_unlock();
+	return e;
+}
+
+static void disk_store(struct cache_entry *e);
+
+/* takes ownership of data. returns the cached entry for (pageno, scale, tile),
+   borrowed if borrow is set. dims is the size of the whole page. */
+static struct cache_entry *cache_insert(int pageno, int scale, int tile, unsigned *data,
+					ddjvu_rect_t *dims, int forced, int borrow)
+{
+	struct cache_entry *e;
+	ddjvu_rect_t r = *dims;
+	if(!(e = calloc(1, sizeof *e))) {
+		free(data);
+		return 0;
+	}
+	if(tile >= 0) tile_rect(dims, tile, &r);
+	e->page = pageno;
+	e->scale = scale;
+	e->tile = tile;
+	e->forced = forced;
+	e->dims = *dims;
+	cache_pack(e, data, r.w, r.h);
+	if(!forced) disk_store(e);
+	return cache_add(e, borrow);
+}
+
+static struct cache_entry *cache_borrow(struct cache_entry *e) {
+	pthread_mutex_lock(&cache.lock);
+	e->refs++;
+	pthread_mutex_unlock(&cache.lock);
+	return e;
+}
+
+static void cache_release(struct cache_entry *e) {
+	if(!e) return;
+	pthread_mutex_lock(&cache.lock);
+	e->refs--;
+	cache_evict(0);
+	cache_unlock();
+}
+
+static void cache_free_list(struct cache_list *l) {
+	struct cache_entry *e, *next;
+	for(e = l->head; e; e = next) {
+		next = e->next;
+		cache_free_entry(e);
+	}
+	l->head = l->tail = 0;
+}
+
+static void cache_shutdown(void) {
+	struct cache_entry *e;
+	cache_free_list(&cache.lru);
+	cache_free_list(&cache.zlru);
+	/* evicted since the last cache_unlock() */
+	while((e = cache.pending)) {
+		cache.pending = e->next;
+		cache_free_entry(e);
+	}
+	cache.used = cache.zused = cache.zraw = 0;
+}
+
+/* the disk cache keeps every page rendered, packed as in memory, in a
+   file named after a fingerprint of the document, the page, scale and
+   tile. files are written under a temporary name and renamed into place,
+   so other instances reading the same book never see half a page, and
+   mapped when read. pages rendered to a forced size are not kept.
+   once the directory outgrows its budget the oldest files are deleted. */
+struct disk_page {
+	char magic[4];
+	/* pixel layout of the display it was rendered for */
+	unsigned masks[4];
+	/* dims are those of the whole page */
+	unsigned format, w, h, npal;
+};
+#define DISK_MAGIC "SDB1"
+/* how much of the start and the end of the document is hashed */
+#define FINGERPRINT_BYTES 65536
+
+/* 0 unless the disk cache is in use */
+static unsigned long long doc_fingerprint;
+
+/* the pages of the document known to be in the disk cache, so
+   pool_next() can hand out djvu pages without decoding them first,
+   without a syscall under cache.lock. pages other instances store are
+   missing until they are loaded or the next disk_scan(), disk_load()
+   looks for them all the same. open addressing, a page of -1 marks a
+   free slot, -2 one that was deleted. protected by cache.lock. */
+static struct disk_index {
+	struct disk_key { int page, scale, tile; } *keys;
+	/* slots in use, deleted ones included */
+	size_t cap, count;
+	/* bytes in the directory, of all documents */
+	size_t used, budget;
+	int scanning;
+} disk;
+
+static size_t disk_hash(int pageno, int scale, int tile) {
+	return ((unsigned) pageno * 2654435761u ^ (unsigned) scale * 40503u ^ (unsigned) (tile + 1) * 97u)
+	       & (disk.cap - 1);
+}
+
+/* caller holds cache.lock */
+static struct disk_key *disk_find(int pageno, int scale, int tile) {
+	size_t i, n;
+	struct disk_key *k;
+	if(!disk.cap) return 0;
+	for(i = disk_hash(pageno, scale, tile), n = 0; n < disk.cap; i = (i + 1) & (disk.cap - 1), n++) {
+		k = &disk.keys[i];
+		if(k->page == -1) break;
+		if(k->page == pageno && k->scale == scale && k->tile == tile) return k;
+	}
+	return 0;
+}
+
+/* caller holds cache.lock. if there is no memory the page is simply
+   not known to be on disk. */
+static void disk_add(int pageno, int scale, int tile) {
+	struct disk_key *old = disk.keys, *k;
+	size_t i, cap = disk.cap;
+	if(disk_find(pageno, scale, tile)) return;
+	if((disk.count + 1) * 2 > disk.cap) {
+		size_t ncap = cap ? cap * 2 : 256;
+		if(!(disk.keys = malloc(ncap * sizeof *disk.keys))) {
+			disk.keys = old;
+			return;
+		}
+		for(i = 0; i < ncap; i++) disk.keys[i].page = -1;
+		disk.cap = ncap;
+		disk.count = 0;
+		for(i = 0; i < cap; i++)
+			if(old[i].page >= 0) disk_add(old[i].page, old[i].scale, old[i].tile);
+		free(old);
+	}
+	for(i = disk_hash(pageno, scale, tile); disk.keys[i].page >= 0; i = (i + 1) & (disk.cap - 1));
+	k = &disk.keys[i];
+	if(k->page == -1) disk.count++;
+	k->page = pageno;
+	k->scale = scale;
+	k->tile = tile;
+}
+
+/* caller holds cache.lock */
+static void disk_del(int pageno, int scale, int tile) {
+	struct disk_key *k = disk_find(pageno, scale, tile);
+	if(k) k->page = -2;
+}
+
+static void disk_forget(int pageno, int scale, int tile) {
+	pthread_mutex_lock(&cache.lock);
+	disk_del(pageno, scale, tile);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+struct disk_file {
+	unsigned long long fp;
+	int page, scale, tile, gone;
+	time_t mtime;
+	size_t size;
+};
+
+static int disk_file_cmp(const void *a, const void *b) {
+	const struct disk_file *fa = a, *fb = b;
+	return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+/* looks at every file in the disk cache: the oldest are deleted until
+   all of them take no more than budget, the pages of the document that
+   remain are added to the index. runs without cache.lock. */
+static void disk_scan(size_t budget) {
+	struct disk_file *files = 0, *grown, f;
+	size_t n = 0, cap = 0, used = 0, i;
+	char path[512];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int end;
+	if(!(dir = opendir(config_data.disk_cache))) return;
+	while((de = readdir(dir))) {
+		end = 0;
+		if(sscanf(de->d_name, "%16llx-%d-%d-%d%n", &f.fp, &f.page, &f.scale, &f.tile, &end) != 4 ||
+		   de->d_name[end])
+			continue;
+		snprintf(path, sizeof path, "%s/%s", config_data.disk_cache, de->d_name);
+		if(stat(path, &st)) continue;
+		if(n == cap) {
+			if(!(grown = realloc(files, (cap + 256) * sizeof *files))) break;
+			files = grown;
+			cap += 256;
+		}
+		f.gone = 0;
+		f.mtime = st.st_mtime;
+		f.size = st.st_size;
+		files[n++] = f;
+		used += f.size;
+	}
+	closedir(dir);
+	qsort(files, n, sizeof *files, disk_file_cmp);
+	for(i = 0; i < n && used > budget; i++) {
+		snprintf(path, sizeof path, "%s/%016llx-%d-%d-%d", config_data.disk_cache,
+			 files[i].fp, files[i].page, files[i].scale, files[i].tile);
+		if(unlink(path) && errno != ENOENT) continue;
+		files[i].gone = 1;
+		used -= files[i].size;
+	}
+	pthread_mutex_lock(&cache.lock);
+	for(i = 0; i < n; i++) {
+		if(files[i].fp != doc_fingerprint) continue;
+		if(files[i].gone) disk_del(files[i].page, files[i].scale, files[i].tile);
+		else disk_add(files[i].page, files[i].scale, files[i].tile);
+	}
+	disk.used = used;
+	pthread_mutex_unlock(&cache.lock);
+	free(files);
+}
+
+/* fnv-1a over size, head and tail of the file. cheap, and independent
+   of where the file lives. returns 0 if it can't be read. */
+static unsigned long long disk_fingerprint(const char *path) {
+	unsigned char buf[4096];
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	struct stat st;
+	size_t n, i;
+	int pass;
+	FILE *f;
+	if(!(f = fopen(path, "rb"))) return 0;
+	if(fstat(fileno(f), &st)) {
+		fclose(f);
+		return 0;
+	}
+	for(i = 0; i < sizeof st.st_size; i++)
+		h = (h ^ ((unsigned long long) st.st_size >> i * 8 & 0xff)) * 0x100000001b3ULL;
+	for(pass = 0; pass < 2; pass++) {
+		size_t left = FINGERPRINT_BYTES;
+		if(pass && st.st_size > FINGERPRINT_BYTES)
+			fseeko(f, st.st_size - FINGERPRINT_BYTES, SEEK_SET);
+		else if(pass) break;
+		while(left && (n = fread(buf, 1, MIN(left, sizeof buf), f))) {
+			for(i = 0; i < n; i++)
+				h = (h ^ buf[i]) * 0x100000001b3ULL;
+			left -= n;
+		}
+	}
+	fclose(f);
+	return h;
+}
+
+static void disk_init(const char *path) {
+	if(!*config_data.disk_cache) return;
+	if(mkdir(config_data.disk_cache, 0700) && errno != EEXIST)
+		fprintf(stderr, "can't create disk cache %s\n", config_data.disk_cache);
+	else if(!(doc_fingerprint = disk_fingerprint(path)))
+		fprintf(stderr, "can't fingerprint %s\n", path);
+	else {
+		disk.budget = (size_t) MAX(config_data.disk_cache_mb, 0) << 20;
+		disk_scan(disk.budget);
+	}
+}
+
+static void disk_path(char *buf, size_t size, int pageno, int scale, int tile) {
+	snprintf(buf, size, "%s/%016llx-%d-%d-%d", config_data.disk_cache,
+		 doc_fingerprint, pageno, scale, tile);
+}
+
+/* caller holds cache.lock */
+static int disk_has(int pageno, int scale, ddjvu_rect_t *forced, int tile) {
+	return doc_fingerprint && !forced && disk_find(pageno, scale, tile);
+}
+
+/* runs on the thread that rendered e, before it is published */
+static void disk_store(struct cache_entry *e) {
+	char path[512], tmp[512];
+	struct disk_page hdr;
+	size_t n;
+	int fd, unit, ok, trim;
+	if(!doc_fingerprint) return;
+	memcpy(hdr.magic, DISK_MAGIC, 4);
+	memcpy(hdr.masks, pixel_masks, sizeof hdr.masks);
+	hdr.format = e->format;
+	hdr.w = e->dims.w;
+	hdr.h = e->dims.h;
+	hdr.npal = e->npal;
+	n = entry_data_size(e, &unit);
+	snprintf(tmp, sizeof tmp, "%s/.tmpXXXXXX", config_data.disk_cache);
+	if((fd = mkstemp(tmp)) == -1) return;
+	ok = write(fd, &hdr, sizeof hdr) == sizeof hdr &&
+	     write(fd, e->pal, e->npal * 4) == e->npal * 4 &&
+	     write(fd, e->data, n) == (ssize_t) n;
+	close(fd);
+	disk_path(path, sizeof path, e->page, e->scale, e->tile);
+	if(!ok || rename(tmp, path)) {
+		unlink(tmp);
+		return;
+	}
+	pthread_mutex_lock(&cache.lock);
+	cache.dstores++;
+	disk_add(e->page, e->scale, e->tile);
+	disk.used += sizeof hdr + e->npal * 4 + n;
+	/* one thread trims, to a bit below the budget so it isn't at it
+	   again right away */
+	if((trim = disk.used > disk.budget && !disk.scanning)) disk.scanning = 1;
+	pthread_mutex_unlock(&cache.lock);
+	if(!trim) return;
+	disk_scan(disk.budget - disk.budget / 8);
+	pthread_mutex_lock(&cache.lock);
+	disk.scanning = 0;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* a new entry for (pageno, scale, tile) from the disk cache, not yet
+   added to the cache. NULL if there is none usable. */
+static struct cache_entry *disk_load(int pageno, int scale, ddjvu_rect_t *forced, int tile) {
+	char path[512];
+	const struct disk_page *hdr;
+	struct cache_entry *e;
+	struct stat st;
+	size_t n;
+	void *map;
+	int fd, unit;
+	if(!doc_fingerprint || forced) return 0;
+	disk_path(path, sizeof path, pageno, scale, tile);
+	if((fd = open(path, O_RDONLY)) == -1) {
+		disk_forget(pageno, scale, tile);
+		return 0;
+	}
+	if(fstat(fd, &st) || st.st_size < sizeof *hdr ||
+	   (map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		disk_forget(pageno, scale, tile);
+		return 0;
+	}
+	close(fd);
+	hdr = map;
+	if(!(e = calloc(1, sizeof *e))) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	e->map = map;
+	e->map_len = st.st_size;
+	e->page = pageno;
+	e->scale = scale;
+	e->tile = tile;
+	e->format = hdr->format;
+	e->dims.w = hdr->w;
+	e->dims.h = hdr->h;
+	e->npal = hdr->npal;
+	if(memcmp(hdr->magic, DISK_MAGIC, 4) || memcmp(hdr->masks, pixel_masks, sizeof hdr->masks) ||
+	   hdr->format > FMT_MONO || hdr->npal > 256 ||
+	   (hdr->format == FMT_PAL8 && !hdr->npal) ||
+	   (hdr->format == FMT_MONO && (hdr->npal < 1 || hdr->npal > 2)) ||
+	   (tile >= 0 && tile >= tile_cols(&e->dims) * tile_rows(&e->dims)) ||
+	   sizeof *hdr + hdr->npal * 4 + (n = entry_data_size(e, &unit)) != st.st_size) {
+		/* stale or broken, leave it to the next trim */
+		cache_free_entry(e);
+		disk_forget(pageno, scale, tile);
+		return 0;
+	}
+	if(e->npal && !(e->pal = malloc(MAX(e->npal, 2) * 4))) {
+		cache_free_entry(e);
+		return 0;
+	}
+	memcpy(e->pal, hdr + 1, e->npal * 4);
+	if(e->npal == 1) e->pal[1] = e->pal[0];
+	e->data = (char*) map + sizeof *hdr + e->npal * 4;
+	e->size = n + e->npal * 4;
+	/* another instance might have stored it */
+	pthread_mutex_lock(&cache.lock);
+	disk_add(pageno, scale, tile);
+	pthread_mutex_unlock(&cache.lock);
+	return e;
+}
+
+static void cache_print_stats(void) {
+	fprintf(stderr, "page cache: %lu hits, %lu misses, %lu evictions, %zu/%zu KB used\n",
+		cache.hits, cache.misses, cache.evictions,
+		cache.used / 1024, cache.budget / 1024);
+	if(cache.zbudget)
+		fprintf(stderr, "compressed tier: %lu hits, %zu/%zu KB used, holding %zu KB, ratio %.1f\n",
+			cache.zhits, cache.zused / 1024, cache.zbudget / 1024, cache.zraw / 1024,
+			cache.zused ? (double) cache.zraw / cache.zused : 0.);
+	if(doc_fingerprint)
+		fprintf(stderr, "disk cache: %lu hits, %lu stored, %zu/%zu KB used\n", cache.dhits, cache.dstores,
+			disk.used / 1024, disk.budget / 1024);
+}
+
+/* a pool of render workers prefetches the pages the reader is heading to
+   into the page cache, so crossing a page boundary usually just swaps
+   pointers. each worker owns a clone of the mupdf context, so several
+   pages can be rasterised at once. its state is protected by cache.lock. */
+#define MAX_WORKERS 8
+#define QUEUE_LEN 64
+/* a page or a tile of it. forced.w is 0 unless it is rendered to
+   a forced size. */
+struct job {
+	int page, scale, tile;
+	ddjvu_rect_t forced;
+};
+#define JOB_FORCED(J) ((J)->forced.w ? &(J)->forced : 0)
+static struct pool {
+	pthread_t threads[MAX_WORKERS];
+	fz_context *ctx[MAX_WORKERS];
+	int count, quit;
+	/* work requested by the UI thread, most urgent first */
+	struct job queue[QUEUE_LEN];
+	int queue_len;
+	/* pages currently being rendered, one slot per worker plus one
+	   for the UI thread. page is -1 if idle. the UI thread sets
+	   cookie.abort under cache.lock when a job is not wanted anymore. */
+	struct { int page, scale, tile; fz_cookie cookie; } busy[MAX_WORKERS+1];
+	/* renders that came to nothing, so they are not queued again.
+	   the oldest is forgotten first. page is -1 if unused. */
+	struct { int page, scale, tile; } failed[QUEUE_LEN];
+	int failed_next;
+} pool;
+#define UI_SLOT MAX_WORKERS
+static int scroll_dir = 1;
+
+/* djvu pages are decoded by djvulibre in the background. handle()
+   marks them ready as the decoder reports progress, and only then a
+   worker picks them up for rendering. a decoded page is kept around for
+   other tiles, scales and revisits, until the estimated size of those
+   nobody needs right now exceeds DECODED_BUDGET. pages that did not
+   finish decoding are dropped as soon as nobody waits for them.
+   protected by cache.lock. */
+#define MAX_DECODES (2*QUEUE_LEN)
+#define DECODED_BUDGET (96 << 20)
+static struct djvu_decode {
+	ddjvu_page_t *page;
+	int pageno;
+	int ready;
+	int users;
+	/* rough size of the decoded page, once ready */
+	size_t size;
+	unsigned long used;
+} decodes[MAX_DECODES];
+static size_t decodes_size;
+static unsigned long decodes_clock;
+
+/* what djvulibre roughly holds in memory for a decoded page: a bit per
+   pixel for the JB2 mask, IW44 coefficients for the background, which
+   in compound pages is usually subsampled by 3. */
+static size_t djvu_decoded_size(ddjvu_page_t *page) {
+	size_t px = (size_t) ddjvu_page_get_width(page) * ddjvu_page_get_height(page);
+	switch(ddjvu_page_get_type(page)) {
+	case DDJVU_PAGETYPE_BITONAL: return px / 8;
+	case DDJVU_PAGETYPE_PHOTO: return px * 4;
+	default: return px / 8 + px * 4 / 9;
+	}
+}
+
+/* caller holds cache.lock */
+static struct djvu_decode *djvu_decode_find(int pageno) {
+	int i;
+	for(i = 0; i < MAX_DECODES; i++)
+		if(decodes[i].page && decodes[i].pageno == pageno)
+			return &decodes[i];
+	return 0;
+}
+
+/* caller holds cache.lock */
+static void djvu_decode_release(struct djvu_decode *d) {
+	ddjvu_page_release(d->page);
+	decodes_size -= d->size;
+	memset(d, 0, sizeof *d);
+}
+
+/* caller holds cache.lock */
+static int djvu_decode_queued(int pageno) {
+	int j;
+	for(j = 0; j < pool.queue_len; j++)
+		if(pool.queue[j].page == pageno) return 1;
+	return 0;
+}
+
+/* caller holds cache.lock. the least recently used decode nobody needs */
+static struct djvu_decode *djvu_decode_idle(void) {
+	struct djvu_decode *d, *lru = 0;
+	for(d = decodes; d < decodes + MAX_DECODES; d++)
+		if(d->page && !d->users && !djvu_decode_queued(d->pageno) &&
+		   (!lru || d->used < lru->used))
+			lru = d;
+	return lru;
+}
+
+/* caller holds cache.lock */
+static struct djvu_decode *djvu_decode_start(int pageno) {
+	struct djvu_decode *d;
+	if((d = djvu_decode_find(pageno))) {
+		d->used = ++decodes_clock;
+		return d;
+	}
+	for(d = decodes; d < decodes + MAX_DECODES; d++)
+		if(!d->page) break;
+	if(d == decodes + MAX_DECODES && !(d = djvu_decode_idle()))
+		return 0;
+	if(d->page) djvu_decode_release(d);
+	if(!(d->page = ddjvu_page_create_by_pageno(DDOC.doc, pageno))) {
+		/* die() handles pending messages, which takes cache.lock */
+		pthread_mutex_unlock(&cache.lock);
+		die("Can't access page %d.", pageno);
+	}
+	d->pageno = pageno;
+	d->used = ++decodes_clock;
+	if((d->ready = ddjvu_page_decoding_done(d->page))) {
+		d->size = djvu_decoded_size(d->page);
+		decodes_size += d->size;
+	}
+	return d;
+}
+
+/* caller holds cache.lock. drops unfinished decodes nobody asks for
+   anymore, and finished ones beyond the budget. */
+static void djvu_decode_prune(void) {
+	struct djvu_decode *d;
+	for(d = decodes; d < decodes + MAX_DECODES; d++)
+		if(d->page && !d->ready && !d->users && !djvu_decode_queued(d->pageno))
+			djvu_decode_release(d);
+	while(decodes_size > DECODED_BUDGET && (d = djvu_decode_idle()))
+		djvu_decode_release(d);
+}
+
+/* called by handle() for every message concerning a page */
+static void djvu_page_event(ddjvu_page_t *page) {
+	int i;
+	pthread_mutex_lock(&cache.lock);
+	for(i = 0; i < MAX_DECODES; i++)
+		if(decodes[i].page == page && !decodes[i].ready && ddjvu_page_decoding_done(page)) {
+			if(ddjvu_page_decoding_error(page))
+				fprintf(stderr, "Can't decode page %d\n", decodes[i].pageno);
+			else
+				decodes[i].size = djvu_decoded_size(page);
+			decodes_size += decodes[i].size;
+			decodes[i].ready = 1;
+			pthread_cond_broadcast(&cache.cond);
+		}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* called by handle() when djvulibre learned more about the document.
+   a window waiting for the size of a page has another look. */
+static void djvu_info_event(void) {
+	pthread_mutex_lock(&cache.lock);
+	cache.generation++;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* caller holds cache.lock. has djvulibre make the thumbnail of pageno,
+   from the one embedded in the document if there is, else by decoding
+   the page in the background. */
+static void djvu_thumb_start(int pageno) {
+	if(!thumb_state[pageno] &&
+	   ddjvu_thumbnail_status(DDOC.doc, pageno, TRUE) >= DDJVU_JOB_OK)
+		thumb_state[pageno] = 1;
+}
+
+/* called by handle() when a thumbnail is done */
+static void djvu_thumb_event(int pageno) {
+	if(pageno < 0 || pageno >= page_count) return;
+	pthread_mutex_lock(&cache.lock);
+	if(ddjvu_thumbnail_status(DDOC.doc, pageno, FALSE) >= DDJVU_JOB_OK) {
+		thumb_state[pageno] = 1;
+		pthread_cond_broadcast(&cache.cond);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* borrows the decoded page pageno for the UI thread, decoding it first
+   if need be. caller holds backend_lock. */
+static ddjvu_page_t *djvu_decode_get(int pageno) {
+	struct djvu_decode *d;
+	ddjvu_page_t *page;
+	pthread_mutex_lock(&cache.lock);
+	if(!(d = djvu_decode_start(pageno))) {
+		pthread_mutex_unlock(&cache.lock);
+		die("Can't access page %d.", pageno);
+	}
+	d->users++;
+	page = d->page;
+	pthread_mutex_unlock(&cache.lock);
+	while (! ddjvu_page_decoding_done(page))
+		handle(TRUE);
+	if (ddjvu_page_decoding_error(page)) {
+		handle(FALSE);
+		die("Can't decode page %d", pageno);
+	}
+	/* the message telling so might not have been handled yet */
+	djvu_page_event(page);
+	return page;
+}
+
+static void djvu_decode_put(ddjvu_page_t *page) {
+	int i;
+	pthread_mutex_lock(&cache.lock);
+	for(i = 0; i < MAX_DECODES; i++)
+		if(decodes[i].page == page) decodes[i].users--;
+	djvu_decode_prune();
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void djvu_decode_shutdown(void) {
+	int i;
+	for(i = 0; i < MAX_DECODES; i++) if(decodes[i].page)
+		djvu_decode_release(&decodes[i]);
+}
+
+/* caller holds cache.lock */
+static int pool_failed(int pageno, int scale, int tile) {
+	int i;
+	if(page_broken[pageno]) return 1;
+	for(i = 0; i < QUEUE_LEN; i++)
+		if(pool.failed[i].page == pageno && pool.failed[i].scale == scale &&
+		   pool.failed[i].tile == tile)
+			return 1;
+	return 0;
+}
+
+/* caller holds cache.lock */
+static void pool_fail(int pageno, int scale, int tile) {
+	if(pool_failed(pageno, scale, tile)) return;
+	fprintf(stderr, "failed to render page %d\n", pageno);
+	pool.failed[pool.failed_next].page = pageno;
+	pool.failed[pool.failed_next].scale = scale;
+	pool.failed[pool.failed_next].tile = tile;
+	pool.failed_next = (pool.failed_next + 1) % QUEUE_LEN;
+}
+
+/* caller holds cache.lock */
+static int pool_is_busy(int pageno, int scale, int tile) {
+	int i;
+	for(i = 0; i <= UI_SLOT; i++)
+		if(pool.busy[i].page == pageno && pool.busy[i].scale == scale &&
+		   pool.busy[i].tile == tile)
+			return 1;
+	return 0;
 }
 
-static void draw() {
-	int x, y, yline;
-	void *pixels;
-	unsigned *ptr;
-	unsigned pitch;
-	int xoff = MAX((int)(ezsdl_get_width() - page_dims.w)/2, 0);
-	int xmax = page_dims.w, ymax = page_dims.h*2;
-	if(scroll_line_v > ymax) return;
-	ymax = MIN(ezsdl_get_height(), ymax-scroll_line_v),
-	xmax = MIN(ezsdl_get_width(), xmax-scroll_line_h);
-	ezsdl_get_vram_and_pitch(&pixels, &pitch);
-	ptr = pixels;
-	pitch/=4;
-	for(y = 0; y < ymax; y++) {
-		yline = y*pitch + xoff;
-		for (x = 0; x < xmax; x++)
-			ptr[yline + x] = get_image_pixel(x+scroll_line_h, y+scroll_line_v);
-	}
-	ezsdl_release_vram();
+static int job_aborted(fz_cookie *cookie) {
+	int abort;
+	if(!cookie) return 0;
+	pthread_mutex_lock(&cache.lock);
+	abort = cookie->abort;
+	pthread_mutex_unlock(&cache.lock);
+	return abort;
 }
 
-static void draw_borders() {
-	int x, y, yline, xoff = MAX((int)(ezsdl_get_width() - page_dims.w)/2, 0);
-	int ymax = ezsdl_get_height();
-	if (!xoff) return;
-	void* pixels;
-	unsigned *vram, *ptr;
-	unsigned pitch;
-	ezsdl_get_vram_and_pitch(&pixels, &pitch);
-	vram = pixels;
-	pitch /= 4;
-	for(y = 0, yline = 0; y < ymax; y++, yline+=pitch)
-		for(x = 0, ptr=vram+yline; x < xoff; x++, ptr++)
-			*ptr = ARGB(0,0,0);
-	for(y = 0, yline = 0; y < ymax; y++, yline+=pitch)
-		for(x = 0, ptr=vram+yline+xoff+page_dims.w; x < xoff; x++, ptr++)
-			*ptr = ARGB(0,0,0);
-	ezsdl_release_vram();
+/* how far along the render of any part of pageno is, in percent.
+   -1 if nothing of it is being rendered or mupdf has not said yet. */
+static int pool_progress(int pageno) {
+	int i, pct, best = -1;
+	pthread_mutex_lock(&cache.lock);
+	for(i = 0; i < pool.count; i++) {
+		fz_cookie *c = &pool.busy[i].cookie;
+		if(pool.busy[i].page != pageno || c->abort || c->progress_max <= 0)
+			continue;
+		pct = (int)(c->progress * 100 / c->progress_max);
+		if(best < 0 || pct < best) best = pct;
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return best;
 }
 
-static void draw_bottom() {
-	int x, y, yline;
-	int xmax, ymax, ymin;
-	ymin = page_dims.h*2-scroll_line_v;
-	if(ymin < 0) return;
-	void *pixels;
-	unsigned *ptr;
-	unsigned pitch;
-	ezsdl_get_vram_and_pitch(&pixels, &pitch);
-	ptr = pixels;
-	pitch /= 4;
-	int xoff = MAX((int)(ezsdl_get_width() - page_dims.w)/2, 0);
-	ymax = ezsdl_get_height();
-	xmax = MIN(ezsdl_get_width(), page_dims.w);
-	for(y = ymin; y < ymax; y++) {
-		yline = y*pitch + xoff;
-		for (x = 0; x < xmax; x++)
-			ptr[yline + x] = ARGB(0,0,0);
+/* caller holds cache.lock. pops the next queued job that needs work,
+   for djvu the first one whose page finished decoding. */
+static int pool_next(struct job *job, struct djvu_decode **dec) {
+	int i = 0;
+	while(i < pool.queue_len) {
+		struct job *j = &pool.queue[i];
+		struct djvu_decode *d = 0;
+		int done = cache_find(j->page, j->scale, JOB_FORCED(j), j->tile) ||
+			   pool_is_busy(j->page, j->scale, j->tile);
+		if(!done && IS_DJVU && j->scale == THUMB_SCALE) {
+			/* wait for djvulibre to come up with it */
+			if(!thumb_state[j->page]) {
+				i++;
+				continue;
+			}
+		} else if(!done && IS_DJVU && !((d = djvu_decode_find(j->page)) && d->ready)) {
+			/* what is on disk needs no decoding */
+			if(!disk_has(j->page, j->scale, JOB_FORCED(j), j->tile)) {
+				i++;
+				continue;
+			}
+			d = 0;
+		}
+		if(!done) *job = *j;
+		memmove(pool.queue+i, pool.queue+i+1, (--pool.queue_len - i) * sizeof *pool.queue);
+		if(done) continue;
+		if(d) {
+			d->users++;
+			d->used = ++decodes_clock;
+			*dec = d;
+		}
+		return 1;
 	}
-	ezsdl_release_vram();
+	return 0;
 }
 
+/* caller holds cache.lock. puts back a djvu job whose file on disk
+   turned out to be unusable, and has the page decoded in the background:
+   decoding it here would race the UI thread for djvulibre's messages. */
+static void pool_requeue(struct job *job) {
+	if(pool.queue_len == QUEUE_LEN) return;
+	memmove(pool.queue+1, pool.queue, pool.queue_len++ * sizeof *pool.queue);
+	pool.queue[0] = *job;
+	djvu_decode_start(job->page);
+}
 
-static int game_tick(int need_redraw) {
-	long long ms_used = 0;
-	if(need_redraw) {
-		long long tstamp = ezsdl_getutime64();
-		draw();
-		if(need_redraw & 2) draw_borders();
-		draw_bottom();
-		ezsdl_refresh();
-		ms_used = ezsdl_getutime64() - tstamp;
+static void *pool_thread(void *arg) {
+	int id = (intptr_t) arg;
+	pthread_mutex_lock(&cache.lock);
+	while(!pool.quit) {
+		struct djvu_decode *d = 0;
+		struct job job;
+		ddjvu_rect_t dims, *forced;
+		unsigned *data = 0;
+		if(!pool_next(&job, &d)) {
+			pthread_cond_wait(&cache.cond, &cache.lock);
+			continue;
+		}
+		forced = JOB_FORCED(&job);
+		pool.busy[id].page = job.page;
+		pool.busy[id].scale = job.scale;
+		pool.busy[id].tile = job.tile;
+		memset(&pool.busy[id].cookie, 0, sizeof pool.busy[id].cookie);
+		/* no need to render what is only compressed */
+		if(!cache_unzip(job.page, job.scale, forced, job.tile)) {
+			struct cache_entry *e;
+			/* a djvu page picked for its file on disk has no decode */
+			int undecoded = IS_DJVU && !d && job.scale != THUMB_SCALE;
+			cache_unlock();
+			if((e = disk_load(job.page, job.scale, forced, job.tile)))
+				cache_add(e, 0);
+			else if(d) data = prep_decoded_page(d->page, job.page, job.scale, &dims, forced, job.tile, &pool.busy[id].cookie);
+			else if(!undecoded) data = prep_page(pool.ctx[id], job.page, job.scale, &dims, forced, job.tile, &pool.busy[id].cookie);
+			if(data) cache_insert(job.page, job.scale, job.tile, data, &dims, !!forced, 0);
+			pthread_mutex_lock(&cache.lock);
+			if(!e && !data && !pool.busy[id].cookie.abort) {
+				if(undecoded) pool_requeue(&job);
+				else pool_fail(job.page, job.scale, job.tile);
+			}
+		}
+		pool.busy[id].page = -1;
+		if(d) {
+			d->users--;
+			djvu_decode_prune();
+		}
+		/* nothing came of it, let the UI thread have another look */
+		if(!data) cache.generation++;
+		pthread_cond_broadcast(&cache.cond);
 	}
-	long sleepms = 1000/fps - ms_used;
-	if(sleepms >= 0) ezsdl_sleep(sleepms);
-
-	tickcounter++;
+	pthread_mutex_unlock(&cache.lock);
 	return 0;
 }
 
-static unsigned* convert_rgb24_to_rgba(char* image, int w, int h, unsigned* new) {
-	bmp3 in = {
-		.width = w,
-		.height = h,
-		.data = image,
-	};
-	bmp4 out = {
-		.width = w,
-		.height = h,
-		.data = new,
-	};
-	bmp3_to_bmp4(&in, &out);
-	return new;
+static void pool_init(int nthreads) {
+	int i;
+	for(i = 0; i <= UI_SLOT; i++)
+		pool.busy[i].page = -1;
+	for(i = 0; i < QUEUE_LEN; i++)
+		pool.failed[i].page = -1;
+	/* djvu pages are rendered one at a time anyway */
+	if(IS_DJVU) nthreads = 1;
+	if(nthreads > MAX_WORKERS) nthreads = MAX_WORKERS;
+	for(i = 0; i < nthreads; i++) {
+		if(!IS_DJVU && !(pool.ctx[i] = fz_clone_context(PDOC.ctx)))
+			break;
+		if(pthread_create(&pool.threads[i], 0, pool_thread, (void*)(intptr_t) i)) {
+			if(pool.ctx[i]) fz_drop_context(pool.ctx[i]);
+			pool.ctx[i] = 0;
+			break;
+		}
+	}
+	pool.count = i;
 }
 
-static void prepare_rect(ddjvu_rect_t *prect, ddjvu_rect_t* desired_rect,
-			double iw, double ih, int dpi)
-{
-	int enforce_aspect_ratio = 1;
+static void pool_shutdown(void) {
+	int i;
+	/* a worker may be stuck behind a lock held by whoever called die() */
+	if(dying) return;
+	pthread_mutex_lock(&cache.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&cache.cond);
+	pthread_mutex_unlock(&cache.lock);
+	for(i = 0; i < pool.count; i++) {
+		pthread_join(pool.threads[i], 0);
+		if(pool.ctx[i]) fz_drop_context(pool.ctx[i]);
+		pool.ctx[i] = 0;
+	}
+	pool.count = 0;
+}
 
-	prect->x = 0;
-	prect->y = 0;
-	if (desired_rect) {
-		prect->w = desired_rect->w;
-		prect->h = desired_rect->h;
-		enforce_aspect_ratio = 0;
-	} else if (config_data.scale > 0) {
-		prect->w = (unsigned int) (iw * (double)config_data.scale) / dpi;
-		prect->h = (unsigned int) (ih * (double)config_data.scale) / dpi;
-	} else {
-		prect->w = (iw * 100) / dpi;
-		prect->h = (ih * 100) / dpi;
+/* replaces the queue with the given jobs, most urgent first */
+static void pool_request(struct job *jobs, int njobs) {
+	int i;
+	if(!pool.count) return;
+	pthread_mutex_lock(&cache.lock);
+	pool.queue_len = 0;
+	for(i = 0; i < njobs && pool.queue_len < QUEUE_LEN; i++)
+		if(jobs[i].page >= 0 && jobs[i].page < page_count &&
+		   !pool_failed(jobs[i].page, jobs[i].scale, jobs[i].tile))
+			pool.queue[pool.queue_len++] = jobs[i];
+	/* cancel the renders nobody asks for anymore */
+	for(i = 0; i < pool.count; i++) {
+		int j;
+		if(pool.busy[i].page < 0) continue;
+		for(j = 0; j < pool.queue_len; j++)
+			if(pool.queue[j].page == pool.busy[i].page &&
+			   pool.queue[j].scale == pool.busy[i].scale &&
+			   pool.queue[j].tile == pool.busy[i].tile)
+				break;
+		if(j == pool.queue_len) pool.busy[i].cookie.abort = 1;
 	}
-	if (enforce_aspect_ratio) {
-		double dw = iw / prect->w;
-		double dh = ih / prect->h;
-		if (dw > dh)
-			prect->h = (int)(ih / dw);
-		else
-			prect->w = (int)(iw / dh);
+	if(IS_DJVU) {
+		djvu_decode_prune();
+		for(i = 0; i < pool.queue_len; i++) {
+			struct job *j = &pool.queue[i];
+			if(cache_find(j->page, j->scale, JOB_FORCED(j), j->tile))
+				continue;
+			if(j->scale == THUMB_SCALE)
+				djvu_thumb_start(j->page);
+			else if(!disk_has(j->page, j->scale, JOB_FORCED(j), j->tile))
+				djvu_decode_start(j->page);
+		}
 	}
+	pthread_cond_broadcast(&cache.cond);
+	pthread_mutex_unlock(&cache.lock);
 }
 
-static void* render_pdf_page(int pageno, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect)
-{
-	ddjvu_rect_t prect;
-	/* mupdf platform/x11/pdfapp.c */
-	fz_page *page;
-	fz_rect bounds;
-	fz_try(PDOC.ctx) {
-		page = fz_load_page(PDOC.ctx, PDOC.doc, pageno);
-		bounds = fz_bound_page(PDOC.ctx, page);
-	}
-	fz_catch(PDOC.ctx) {
-		die("failed to load page %d\n", pageno);
+/* borrow the cached page or tile for (pageno, scale, tile). if sync is
+   set the caller is going to render it on a miss, so wait for the render
+   workers if one of them is rendering it right now. */
+static struct cache_entry *cache_get(int pageno, int scale, ddjvu_rect_t *forced, int tile, int sync) {
+	struct cache_entry *e;
+	pthread_mutex_lock(&cache.lock);
+	while(sync && !forced && pool_is_busy(pageno, scale, tile))
+		pthread_cond_wait(&cache.cond, &cache.lock);
+	if((e = cache_find(pageno, scale, forced, tile))) {
+		cache_unlink(&cache.lru, e);
+		cache_push_front(&cache.lru, e);
+		e->refs++;
+		cache.hits++;
+	} else if((e = cache_unzip(pageno, scale, forced, tile))) {
+		e->refs++;
+	} else {
+		/* the caller renders it, keep the workers off it */
+		if(sync && !forced) {
+			pool.busy[UI_SLOT].page = pageno;
+			pool.busy[UI_SLOT].scale = scale;
+			pool.busy[UI_SLOT].tile = tile;
+		}
 	}
+	cache_unlock();
+	return e;
+}
 
-	double iw = bounds.x1 - bounds.x0;
-	double ih = bounds.y1 - bounds.y0;
-	int dpi = 72;
+static void cache_get_done(void) {
+	pthread_mutex_lock(&cache.lock);
+	pool.busy[UI_SLOT].page = -1;
+	pthread_cond_broadcast(&cache.cond);
+	pthread_mutex_unlock(&cache.lock);
+}
 
-	prepare_rect(&prect, desired_rect, iw, ih, dpi);
+/* a serial for something that is not a cache entry */
+static unsigned long cache_new_serial(void) {
+	unsigned long serial;
+	pthread_mutex_lock(&cache.lock);
+	serial = ++cache.serial;
+	pthread_mutex_unlock(&cache.lock);
+	return serial;
+}
 
-	int rowsize = prect.w * 3;
-	void *image;
-	if(!(image = malloc(rowsize * prect.h)))
-		die("Cannot allocate image buffer for page %d", pageno);
+static void page_set_broken(int pageno) {
+	pthread_mutex_lock(&cache.lock);
+	page_broken[pageno] = 1;
+	pthread_mutex_unlock(&cache.lock);
+}
 
-	fz_matrix ctm;
-	fz_pixmap *pix;
+static unsigned long cache_generation(void) {
+	unsigned long gen;
+	pthread_mutex_lock(&cache.lock);
+	gen = cache.generation;
+	pthread_mutex_unlock(&cache.lock);
+	return gen;
+}
 
-	ctm = fz_scale((double) prect.w / iw, (double) prect.h / ih);
-	pix = fz_new_pixmap_from_page(PDOC.ctx, page, ctm, fz_device_rgb(PDOC.ctx), 0);
+/* UI thread only. unless sync is set or there are no workers, the page
+   or tile is left to them and NULL is returned until they are done. */
+static struct cache_entry *get_page(int pageno, int scale, ddjvu_rect_t *forced, int tile, int sync) {
+	struct cache_entry *e;
+	ddjvu_rect_t dims;
+	unsigned *data;
+	int failed;
+	sync |= !pool.count;
+	if((e = cache_get(pageno, scale, forced, tile, sync)) || !sync) return e;
+	pthread_mutex_lock(&cache.lock);
+	failed = pool_failed(pageno, scale, tile);
+	pthread_mutex_unlock(&cache.lock);
+	if(!failed) {
+		if((e = disk_load(pageno, scale, forced, tile)))
+			e = cache_add(e, 1);
+		else if((data = prep_page(IS_DJVU ? 0 : PDOC.ctx, pageno, scale, &dims, forced, tile, 0)))
+			e = cache_insert(pageno, scale, tile, data, &dims, !!forced, 1);
+		/* a djvu thumbnail may just not be done yet */
+		else if(!IS_DJVU || scale != THUMB_SCALE) {
+			pthread_mutex_lock(&cache.lock);
+			pool_fail(pageno, scale, tile);
+			pthread_mutex_unlock(&cache.lock);
+		}
+	}
+	cache_get_done();
+	return e;
+}
 
-	fz_drop_page(PDOC.ctx, page);
+/* natural size of every page, gathered by page_index() when the document
+   is opened, so the size of a page is known before it is rendered.
+   UI thread only. */
+static struct page_geom {
+	double w, h;
+	/* 0 until asked for, -1 if the page can't be loaded */
+	int dpi;
+} *page_geom;
+
+/* size of page pageno at scale. returns 0 if it is not known (yet),
+   which happens for djvu pages whose info was still being decoded at
+   open time. if query is set the backend is asked again. */
+static int page_size(int pageno, int scale, ddjvu_rect_t *rect, int query) {
+	struct page_geom *g = &page_geom[pageno];
+	if(!g->dpi && query) {
+		pthread_mutex_lock(&backend_lock);
+		if(IS_DJVU) {
+			ddjvu_pageinfo_t info;
+			if(ddjvu_document_get_pageinfo(DDOC.doc, pageno, &info) == DDJVU_JOB_OK) {
+				g->w = info.width;
+				g->h = info.height;
+				g->dpi = info.dpi;
+			}
+		} else {
+			fz_page *page;
+			fz_rect bounds;
+			fz_try(PDOC.ctx) {
+				page = fz_load_page(PDOC.ctx, PDOC.doc, pageno);
+				bounds = fz_bound_page(PDOC.ctx, page);
+				fz_drop_page(PDOC.ctx, page);
+				g->w = bounds.x1 - bounds.x0;
+				g->h = bounds.y1 - bounds.y0;
+				g->dpi = 72;
+			}
+			fz_catch(PDOC.ctx) {
+				/* laid out with a guessed size */
+				fprintf(stderr, "failed to load page %d\n", pageno);
+				g->dpi = -1;
+				page_set_broken(pageno);
+			}
+		}
+		pthread_mutex_unlock(&backend_lock);
+		if(g->dpi > 0) layout_dirty = 1;
+	}
+	if(g->dpi <= 0) return 0;
+	prepare_rect(rect, 0, g->w, g->h, g->dpi, scale);
+	return 1;
+}
 
-	if (!pix) {
-		free(image);
-		return NULL;
+/* the size of the thumbnail of pageno, the page fit into THUMB_W x
+   THUMB_H. pages of unknown size are assumed to be like page_dims. */
+static void thumb_dims(int pageno, ddjvu_rect_t *r) {
+	ddjvu_rect_t p;
+	if(!page_size(pageno, 100, &p, 0)) p = page_dims;
+	r->x = r->y = 0;
+	if((size_t) p.w * THUMB_H > (size_t) p.h * THUMB_W) {
+		r->w = THUMB_W;
+		r->h = MAX((size_t) p.h * THUMB_W / p.w, 1);
+	} else {
+		r->h = THUMB_H;
+		r->w = MAX((size_t) p.w * THUMB_H / MAX(p.h, 1), 1);
 	}
-	assert(pix->w >= prect.w && pix->h >= prect.h);
+}
 
-	unsigned char* out, *s;
-	unsigned x,y,xn;
-	for (y = 0, out = image; y < prect.h; y++) {
-		s = &pix->samples[y * pix->stride];
-		xn = 0;
-		for (x = 0; x < prect.w; x++, xn += pix->n) {
-			*(out++) = s[xn + 0];
-			*(out++) = s[xn + 1];
-			*(out++) = s[xn + 2];
-		}
+/* lays the strip out anew at scale if that changed, or a page learned
+   its size. returns 1 if it did. */
+static int layout_update(int scale) {
+	ddjvu_rect_t guess = page_dims, r;
+	int i;
+	if(!layout_dirty && layout_scale == scale) return 0;
+	for(i = 0; i < page_count; i++)
+		if(page_size(i, scale, &guess, 0)) break;
+	layout_w = 0;
+	for(i = 0; i < page_count; i++) {
+		if(!page_size(i, scale, &r, 0)) r = guess;
+		page_top[i + 1] = page_top[i] + r.h;
+		layout_w = MAX(layout_w, (int) r.w);
 	}
-	fz_drop_pixmap(PDOC.ctx, pix);
+	layout_scale = scale;
+	layout_dirty = 0;
+	layout_gen++;
+	return 1;
+}
 
-	*res_rect = prect;
-	return image;
+/* the page at offset y of the strip */
+static int layout_find(long long y) {
+	int lo = 0, hi = page_count - 1, mid;
+	while(lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if(page_top[mid] <= y) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
 }
 
+/* how many pages the window needs: those that start above the bottom of
+   the viewport when it is scrolled to the end of curr_page. */
+static int view_wanted(void) {
+	long long bottom = page_top[curr_page + 1] + ezsdl_get_height();
+	int n = 1;
+	while(n < VIEW_MAX && curr_page + n < page_count && page_top[curr_page + n] < bottom)
+		n++;
+	return n;
+}
 
-static char* render_page(ddjvu_page_t *page, int pageno, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect)
-{
-	ddjvu_rect_t prect; // pixels of image
-	ddjvu_rect_t rrect; // pixels of segment (info_segment)
-	ddjvu_format_style_t style;
-	ddjvu_render_mode_t mode;
-	ddjvu_format_t *fmt;
-	int iw = ddjvu_page_get_width(page);
-	int ih = ddjvu_page_get_height(page);
-	int dpi = ddjvu_page_get_resolution(page);
-	ddjvu_page_type_t type = ddjvu_page_get_type(page);
-	char *image = 0;
-	char white = 0xFF;
-	int rowsize;
+/* looks up the size of every page without rendering any. bundled djvu
+   documents carry them in their directory, mupdf only has to load the
+   page objects. */
+static void page_index(void) {
+	ddjvu_rect_t r;
+	int i;
+	for(i = 0; i < page_count; i++)
+		page_size(i, 100, &r, 1);
+}
 
-	prepare_rect(&prect, desired_rect, iw, ih, dpi);
+/* the window is pending as long as something of it is still missing */
+static int view_page = -1, view_scale, view_pending;
+static unsigned long view_generation;
 
-	rrect = prect;
-#if 0
-	// show only section/segment of rendered image
-	if (segment_given > 0) {
-		rrect = segment_rect;
-		if (rrect.x < 0)
-			rrect.x = prect.w - rrect.w + rrect.x;
-		if (rrect.y < 0)
-			rrect.y = prect.h - rrect.h + rrect.y;
-	}
-#endif
+/* zooming only resamples what is on display. nothing is rendered at the
+   new scale until it stayed put for ZOOM_SETTLE_MS, view_settle is the
+   time in usec that happens, 0 once it did. */
+#define ZOOM_SETTLE_MS 150
+static long long view_settle;
 
-	mode = DDJVU_RENDER_COLOR;
-	style = DDJVU_FORMAT_RGB24;
+/* get_page for the window, a mere cache lookup while the zoom settles */
+static struct cache_entry *view_get(int pageno, int scale, ddjvu_rect_t *forced, int tile, int sync) {
+	if(view_settle) return cache_get(pageno, scale, forced, tile, 0);
+	return get_page(pageno, scale, forced, tile, sync);
+}
 
-	if (!(fmt = ddjvu_format_create(style, 0, 0)))
-		die("Cannot determine pixel style for page %d", pageno);
+static void view_drop_tiles(struct view_slot *v) {
+	int i;
+	for(i = 0; i < v->tw * v->th; i++)
+		cache_release(v->tiles[i]);
+	free(v->tiles);
+	v->tiles = 0;
+	v->tw = v->th = 0;
+}
 
-	ddjvu_format_set_row_order(fmt, 1);
+static void view_clear(struct view_slot *v) {
+	cache_release(v->whole);
+	cache_release(v->preview);
+	free(v->zoomed);
+	view_drop_tiles(v);
+	memset(v, 0, sizeof *v);
+	v->page = -1;
+}
 
-	if (style == DDJVU_FORMAT_MSBTOLSB) {
-		rowsize = (rrect.w + 7) / 8;
-		white = 0;
-	} else if (style == DDJVU_FORMAT_GREY8)
-		rowsize = rrect.w;
-	else
-		rowsize = rrect.w * 3;
-	if(!(image = malloc(rowsize * rrect.h)))
-		die("Cannot allocate image buffer for page %d", pageno);
+static void view_setup(int i, int scale) {
+	struct view_slot *v = &view[i];
+	v->page = curr_page + i < page_count ? curr_page + i : -1;
+	v->dims.w = v->dims.h = 0;
+	if(v->page >= 0 && !page_size(v->page, scale, &v->dims, 1))
+		v->dims.w = v->dims.h = 0;
+	v->tiled = v->dims.w && page_is_tiled(&v->dims);
+}
 
-	/* fill image with white in case rendering fails */
-	if(!ddjvu_page_render(page, mode, &prect, &rrect, fmt, rowsize, image))
-		memset(image, white, rowsize * rrect.h);
+/* pages are first shown from a quick render at a fraction of the scale,
+   stretched, until the real one arrives. previews are rendered to the
+   size preview_scale() gives, so like all forced renders they are not
+   kept in the disk cache. */
+#define PREVIEW_DIV 4
+#define PREVIEW_BYTES (1 << 20)
+
+/* the scale the preview of slot v is rendered at, 0 if it gets none.
+   pdims receives its size. */
+static int preview_scale(struct view_slot *v, int scale, ddjvu_rect_t *pdims) {
+	int ps;
+	if(!v->dims.w) return 0;
+	for(ps = scale / PREVIEW_DIV; ps > 0; ps /= 2) {
+		pdims->x = pdims->y = 0;
+		pdims->w = (size_t) v->dims.w * ps / scale;
+		pdims->h = (size_t) v->dims.h * ps / scale;
+		if((size_t) pdims->w * pdims->h * 4 <= PREVIEW_BYTES) break;
+	}
+	return ps > 0 && pdims->w && pdims->h ? ps : 0;
+}
 
-	ddjvu_format_release(fmt);
-	*res_rect = rrect;
-	return image;
+static void view_preview(int i, int scale, int sync) {
+	struct view_slot *v = &view[i];
+	ddjvu_rect_t pdims;
+	int ps;
+	if(v->page < 0 || v->whole || v->preview || !(ps = preview_scale(v, scale, &pdims)))
+		return;
+	v->preview = view_get(v->page, ps, &pdims, -1, sync);
 }
 
-static void* prep_page(int pageno, ddjvu_rect_t *res_rect, ddjvu_rect_t *desired_rect)
-{
-	if(pageno >= page_count) return 0;
-	if(!IS_DJVU)
-		return render_pdf_page(pageno, res_rect, desired_rect);
+/* right after a zoom, slot v takes over what old showed of the same
+   page. tiled pages are too large to resample in one go, they stretch
+   it on the fly like a preview. */
+static void view_zoom(struct view_slot *v, struct view_slot *old) {
+	struct cache_entry *e;
+	const unsigned *src = 0;
+	ddjvu_rect_t sdims;
+	if(v->page < 0 || v->page != old->page || v->whole || !v->dims.w) return;
+	if(v->tiled) {
+		if(!v->preview && (old->whole || old->preview))
+			v->preview = cache_borrow(old->whole ? old->whole : old->preview);
+		return;
+	}
+	if(!(e = old->whole) && !old->zoomed) e = old->preview;
+	if(e) {
+		src = entry_pixels(e);
+		sdims = e->dims;
+	} else if(old->zoomed) {
+		src = old->zoomed;
+		sdims = old->dims;
+	}
+	if(src && (v->zoomed = malloc((size_t) v->dims.w * v->dims.h * 4))) {
+		if(bmp4_resample(src, sdims.w, sdims.h, v->zoomed, v->dims.w, v->dims.h))
+			v->zoomed_serial = cache_new_serial();
+		else {
+			free(v->zoomed);
+			v->zoomed = 0;
+		}
+	}
+	if(e && src) entry_pixels_done(e, src);
+}
 
-	ddjvu_page_t *page;
-	if (!(page = ddjvu_page_create_by_pageno(DDOC.doc, pageno)))
-		die("Can't access page %d.", pageno);
-	while (! ddjvu_page_decoding_done(page))
-		handle(TRUE);
-	if (ddjvu_page_decoding_error(page)) {
-		handle(FALSE);
-		die("Can't decode page %d", pageno);
+/* tiles of slot i inside the viewport, grown by margin tiles on each
+   side. returns 0 if none. */
+static int view_grid(int i, int margin, int *x0, int *y0, int *x1, int *y1) {
+	struct view_slot *v = &view[i];
+	int m = margin * TILE_SIZE;
+	int top = scroll_line_v - view_top(i) - m;
+	int bottom = top + ezsdl_get_height() + 2 * m;
+	int left = scroll_line_h - view_left(v) - m;
+	int right = left + ezsdl_get_width() + 2 * m;
+	top = MAX(top, 0);
+	left = MAX(left, 0);
+	bottom = MIN(bottom, (int) v->dims.h);
+	right = MIN(right, (int) v->dims.w);
+	if(top >= bottom || left >= right) return 0;
+	*x0 = left / TILE_SIZE;
+	*y0 = top / TILE_SIZE;
+	*x1 = (right + TILE_SIZE - 1) / TILE_SIZE;
+	*y1 = (bottom + TILE_SIZE - 1) / TILE_SIZE;
+	return 1;
+}
+
+/* makes the tiles of slot i follow the viewport: the ones that left
+   the grid are given back to the cache, the new ones borrowed from it.
+   unless all is set only a moved grid is looked at. returns 1 if the
+   grid changed. */
+static int view_tiles(int i, int scale, int all) {
+	struct view_slot *v = &view[i];
+	struct cache_entry **tiles = 0, *e;
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0, x, y, cols = tile_cols(&v->dims);
+	view_grid(i, TILE_MARGIN, &x0, &y0, &x1, &y1);
+	if(x0 == v->tx && y0 == v->ty && x1 - x0 == v->tw && y1 - y0 == v->th) {
+		if(all) for(y = y0; y < y1; y++) for(x = x0; x < x1; x++)
+			if(!v->tiles[(y - y0) * v->tw + x - x0])
+				v->tiles[(y - y0) * v->tw + x - x0] =
+					view_get(v->page, scale, 0, y * cols + x, 0);
+		return 0;
 	}
-	void *image = render_page(page, pageno, res_rect, desired_rect);
-	ddjvu_page_release(page);
-	return image;
+	if(x1 > x0 && !(tiles = calloc((x1 - x0) * (y1 - y0), sizeof *tiles)))
+		die("Cannot allocate tile grid");
+	for(y = y0; y < y1; y++) for(x = x0; x < x1; x++) {
+		if((e = view_tile(v, x, y)))
+			v->tiles[(y - v->ty) * v->tw + x - v->tx] = 0;
+		else
+			e = view_get(v->page, scale, 0, y * cols + x, 0);
+		tiles[(y - y0) * (x1 - x0) + x - x0] = e;
+	}
+	view_drop_tiles(v);
+	v->tiles = tiles;
+	v->tx = x0;
+	v->ty = y0;
+	v->tw = x1 - x0;
+	v->th = y1 - y0;
+	return 1;
+}
+
+static int view_missing(void) {
+	int i, j;
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0) continue;
+		if(!v->tiled && !v->whole) return 1;
+		if(v->tiled) for(j = 0; j < v->tw * v->th; j++)
+			if(!v->tiles[j]) return 1;
+	}
+	return 0;
+}
+
+static void job_add(struct job *jobs, int *n, int page, int scale, int tile, ddjvu_rect_t *forced) {
+	if(*n >= QUEUE_LEN) return;
+	jobs[*n].page = page;
+	jobs[*n].scale = scale;
+	jobs[*n].tile = tile;
+	jobs[*n].forced.w = jobs[*n].forced.h = 0;
+	if(forced) jobs[*n].forced = *forced;
+	++*n;
+}
+
+/* queue the work around curr_page for the workers: the previews of the
+   window first, then what is missing of it, the tiles inside the viewport
+   before the margin, then the pages ahead in scroll direction. pages
+   ahead that will be tiled are not prefetched. nothing is queued while
+   the zoom settles. */
+static void view_request(int scale) {
+	struct job jobs[QUEUE_LEN];
+	int n = 0, i, ps, pass, inner, x, y;
+	int x0, y0, x1, y1, vx0, vy0, vx1, vy1;
+	ddjvu_rect_t dims;
+	if(view_settle) return;
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0 || v->whole || v->preview || !(ps = preview_scale(v, scale, &dims)))
+			continue;
+		job_add(jobs, &n, v->page, ps, -1, &dims);
+	}
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0 || v->tiled || v->whole) continue;
+		job_add(jobs, &n, v->page, scale, -1, 0);
+	}
+	for(pass = 0; pass < 2; pass++) for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0 || !v->tiled ||
+		   !view_grid(i, pass ? TILE_MARGIN : 0, &x0, &y0, &x1, &y1))
+			continue;
+		if(!view_grid(i, 0, &vx0, &vy0, &vx1, &vy1))
+			vx0 = vx1 = vy0 = vy1 = 0;
+		for(y = y0; y < y1; y++) for(x = x0; x < x1; x++) {
+			/* the second pass only adds the margin */
+			inner = x >= vx0 && x < vx1 && y >= vy0 && y < vy1;
+			if(pass == inner || view_tile(v, x, y)) continue;
+			job_add(jobs, &n, v->page, scale, y * tile_cols(&v->dims) + x, 0);
+		}
+	}
+	for(i = 1; i <= pool.count; i++) {
+		int page = scroll_dir > 0 ? curr_page + view_count - 1 + i : curr_page - i;
+		if(page < 0 || page >= page_count) continue;
+		/* a djvu page whose info is still missing is most likely
+		   like this one */
+		if(!page_size(page, scale, &dims, 0)) dims = page_dims;
+		if(!page_is_tiled(&dims)) job_add(jobs, &n, page, scale, -1, 0);
+	}
+	pool_request(jobs, n);
+}
+
+static void view_update_dims(void) {
+	int i;
+	for(i = 0; i < view_count; i++)
+		if(view[i].dims.w) {
+			page_dims = view[i].dims;
+			break;
+		}
 }
 
-static void* prep_pages(int *need_redraw) {
-	ddjvu_rect_t p1rect, p2rect;
-	static int last_page = -1, last_scale = -1;
-	if(curr_page == last_page && last_scale == config_data.scale)
-		return image_data;
-	last_page = curr_page;
-	last_scale = config_data.scale;
+/* slide the window to curr_page. pages already on display are found in
+   the cache, so advancing by one page renders only one page.
+   the rest is left to the workers, meanwhile missing pages and tiles are
+   shown from their previews, or as placeholders. */
+static void prep_pages(int *need_redraw) {
+	struct view_slot old[VIEW_MAX];
+	int scale = config_data.scale, old_w = layout_w, old_count = view_count, i, j;
+	int same = view_page == curr_page && view_scale == scale;
+	int zoom = view_page != -1 && view_scale != scale;
+	layout_update(scale);
+	if(same && !view_pending && view_count == view_wanted())
+		return;
+	if(view_page != -1 && curr_page != view_page)
+		scroll_dir = curr_page < view_page ? -1 : 1;
+	if(zoom)
+		view_settle = ezsdl_getutime64() + ZOOM_SETTLE_MS * 1000LL;
 	if(need_redraw) *need_redraw = 1;
-	char *p1data = prep_page(curr_page, &p1rect, 0);
-	char *p2data = prep_page(curr_page+1, &p2rect, 0);
-	if(!p2data) {
-		/* probably last page hit */
-		p2data = calloc(3,p1rect.w*p1rect.h);
-		p2rect = p1rect;
+	view_generation = cache_generation();
+	memcpy(old, view, sizeof old);
+	view_count = view_wanted();
+	if(same) {
+		/* pending window, only look for what is still missing. a
+		   djvu page may have learned its size meanwhile, or the
+		   window grew or shrank with the viewport. */
+		memset(old, 0, sizeof old);
+		for(i = 0; i < VIEW_MAX; i++) {
+			if(i >= view_count) {
+				old[i] = view[i];
+				memset(&view[i], 0, sizeof view[i]);
+			} else if(i >= old_count) {
+				memset(&view[i], 0, sizeof view[i]);
+				view_setup(i, scale);
+			} else if(!view[i].dims.w && !view[i].whole)
+				view_setup(i, scale);
+		}
+	} else {
+		memset(view, 0, sizeof view);
+		for(i = 0; i < view_count; i++)
+			view_setup(i, scale);
+	}
+	layout_update(scale);
+	view_update_dims();
+	view_page = curr_page;
+	view_scale = scale;
+	for(i = 0; i < view_count; i++) {
+		struct view_slot *v = &view[i];
+		if(v->page < 0) continue;
+		if(v->tiled) view_tiles(i, scale, 1);
+		else if(!v->whole) {
+			v->whole = view_get(v->page, scale, 0, -1, 0);
+			if(v->whole) v->dims = v->whole->dims;
+		}
+	}
+	if(zoom)
+		for(i = 0; i < view_count; i++)
+			for(j = 0; j < old_count; j++)
+				view_zoom(&view[i], &old[j]);
+	if(pool.count) {
+		/* mupdf renders the preview of the first page right away,
+		   it takes a fraction of the time of the real one. */
+		if(!IS_DJVU) view_preview(0, scale, 1);
+		view_request(scale);
+		for(i = 0; i < view_count; i++)
+			view_preview(i, scale, 0);
 	}
-	if(p1rect.w != p2rect.w || p1rect.h != p2rect.h) {
-		/* sometimes the start page of a book has a different format */
-		free(p1data);
-		p1data = prep_page(curr_page, &p1rect, &p2rect);
-		if(need_redraw) *need_redraw = 2;
+	for(i = 0; i < view_count; i++) {
+		if(view[i].whole && view[i].preview) {
+			cache_release(view[i].preview);
+			view[i].preview = 0;
+		}
+		if(view[i].whole && view[i].zoomed) {
+			free(view[i].zoomed);
+			view[i].zoomed = 0;
+		}
 	}
-	if(!(p1data && p2data)) return NULL;
-	assert(p1rect.w == p2rect.w && p1rect.h == p2rect.h);
+	for(i = 0; i < VIEW_MAX; i++)
+		view_clear(&old[i]);
+	view_update_dims();
+	view_pending = view_missing();
+	if(scroll_line_v >= layout_h(curr_page))
+		scroll_line_v = MAX(layout_h(curr_page) - 1, 0);
+	if(need_redraw && layout_w != old_w) *need_redraw = 2;
+}
+
+/* the viewport moved within the window: tiled pages pick up the tiles
+   that scrolled into reach and queue the ones missing. */
+static void view_scroll(void) {
+	int i, moved = 0;
+	for(i = 0; i < view_count; i++)
+		if(view[i].page >= 0 && view[i].tiled)
+			moved |= view_tiles(i, view_scale, 0);
+	if(!moved) return;
+	view_request(view_scale);
+	view_pending = view_missing();
+}
 
-	size_t one_pic = p1rect.w*p1rect.h;
-	unsigned* imgbuf = malloc(4 * one_pic * 2);
+/* called every tick: pumps the djvu decoder messages and picks up pages
+   and tiles the workers finished in the meantime. */
+static int overview_update(void);
 
-	convert_rgb24_to_rgba(p1data, p1rect.w, p1rect.h, imgbuf);
-	convert_rgb24_to_rgba(p2data, p2rect.w, p2rect.h, imgbuf+one_pic);
-	page_dims = p1rect;
-	free(p1data);
-	free(p2data);
-	return imgbuf;
+static int poll_pages(void) {
+	int need_redraw = 0;
+	handle(FALSE);
+	if(overview)
+		return cache_generation() != thumbs_generation && overview_update();
+	if(view_settle && ezsdl_getutime64() >= view_settle) {
+		/* the zoom came to rest, render for real */
+		view_settle = 0;
+		view_pending = 1;
+		prep_pages(&need_redraw);
+	}
+	view_scroll();
+	if((view_pending && cache_generation() != view_generation) ||
+	   (view_page != -1 && view_count != view_wanted()))
+		prep_pages(&need_redraw);
+	if(pool_progress(curr_page) != render_progress)
+		update_title();
+	return need_redraw;
 }
 
 static void handle(int wait) {
@@ -471,11 +2864,25 @@ static void handle(int wait) {
 		msg = ddjvu_message_wait(DDOC.ctx);
 	while ((msg = ddjvu_message_peek(DDOC.ctx)))	{
 		switch(msg->m_any.tag) {
+		case DDJVU_THUMBNAIL:
+			djvu_thumb_event(msg->m_thumbnail.pagenum);
+			break;
+		case DDJVU_PAGEINFO:
+		case DDJVU_CHUNK:
+			if(msg->m_any.page)
+				djvu_page_event(msg->m_any.page);
+			/* the size of a page might be known now */
+			if(msg->m_any.tag == DDJVU_PAGEINFO || !msg->m_any.page)
+				djvu_info_event();
+			break;
 		case DDJVU_ERROR:
 			fprintf(stderr,"ddjvu: %s\n", msg->m_error.message);
 			if (msg->m_error.filename)
 				fprintf(stderr,"ddjvu: '%s:%d'\n",
 				        msg->m_error.filename, msg->m_error.lineno);
+			if(msg->m_any.page)
+				djvu_page_event(msg->m_any.page);
+			break;
 		default:
 			break;
 		}
@@ -483,19 +2890,12 @@ static void handle(int wait) {
 	}
 }
 
-static void swap_image(void *new) {
-	void *old = image_data;
-	if(old == new) return;
-	image_data = new;
-	free(old);
-}
-
 static int set_page(int no) {
 	int need_redraw;
 	if(no >= page_count) no = page_count-1;
 	if(no < 0) curr_page = 0;
 	else curr_page = no;
-	swap_image(prep_pages(&need_redraw));
+	prep_pages(&need_redraw);
 	update_title();
 	return need_redraw;
 }
@@ -508,7 +2908,7 @@ static int change_page(int incr) {
 		curr_page = page_count -1;
 	else
 		curr_page += incr;
-	swap_image(prep_pages(&need_redraw));
+	prep_pages(&need_redraw);
 	update_title();
 	return need_redraw;
 }
@@ -518,35 +2918,31 @@ static int change_scale(int incr) {
 	if (config_data.scale + incr <= 999 && config_data.scale + incr > 0)
 		config_data.scale += incr;
 	else return 0;
-	swap_image(prep_pages(&need_redraw));
+	prep_pages(&need_redraw);
 	update_title();
-	if(scroll_line_h + ezsdl_get_width() > page_dims.w) {
-		scroll_line_h = MAX((int)(page_dims.w - ezsdl_get_width()), 0);
+	if(scroll_line_h + ezsdl_get_width() > layout_w) {
+		scroll_line_h = MAX((int)(layout_w - ezsdl_get_width()), 0);
 		return 2;
 	}
 	return incr < 0 ? 2 : need_redraw;
 }
 
+/* moves the viewport along the strip, the page it then starts in
+   becomes curr_page. */
 static int change_scroll_v(int incr) {
-	int ph = page_dims.h;
-	scroll_line_v += incr;
-	int pages = scroll_line_v / ph;
-	if(scroll_line_v < 0) --pages;
-	scroll_line_v -= pages * ph;
-	if(curr_page + pages < 0) {
-		pages = -curr_page;
-		scroll_line_v = 0;
-	} else if(curr_page + pages >= page_count-1) {
-		pages = page_count-1 - curr_page;
-		scroll_line_v = MIN(scroll_line_v, abs(ph - ezsdl_get_height()));
-	}
-	if(pages) change_page(pages);
-	if(scroll_line_v < 0) scroll_line_v += ph;
+	long long y = page_top[curr_page] + scroll_line_v + incr;
+	long long ymax = page_top[page_count] - ezsdl_get_height();
+	int page;
+	if(y > ymax) y = ymax;
+	if(y < 0) y = 0;
+	page = layout_find(y);
+	scroll_line_v = y - page_top[page];
+	if(page != curr_page) change_page(page - curr_page);
 	return 1;
 }
 
 static int change_scroll_h(int incr) {
-	int sw = ezsdl_get_width(), pw = page_dims.w;
+	int sw = ezsdl_get_width(), pw = layout_w;
 	int old_scroll = scroll_line_h;
 	if (scroll_line_h + incr <= 0)
 		scroll_line_h = 0;
@@ -555,6 +2951,134 @@ static int change_scroll_h(int incr) {
 	return old_scroll != scroll_line_h;
 }
 
+/* borrows the thumbnails of the pages in view and queues the missing
+   ones, then those a screen below and above. returns 1 if any of
+   them arrived. */
+static int overview_update(void) {
+	struct job jobs[QUEUE_LEN];
+	ddjvu_rect_t r;
+	int cols = overview_cols(), screen = (ezsdl_get_height() / CELL_H + 2) * cols;
+	int first = overview_y / CELL_H * cols, last = MIN(first + screen, page_count);
+	int i, n = 0, got = 0;
+	thumbs_generation = cache_generation();
+	for(i = 0; i < page_count; i++) {
+		if(i < first || i >= last) {
+			cache_release(thumbs[i]);
+			thumbs[i] = 0;
+		} else if(!thumbs[i]) {
+			thumb_dims(i, &r);
+			if((thumbs[i] = get_page(i, THUMB_SCALE, &r, -1, 0))) got = 1;
+			else job_add(jobs, &n, i, THUMB_SCALE, -1, &r);
+		}
+	}
+	for(i = last; i < MIN(last + screen, page_count); i++) {
+		thumb_dims(i, &r);
+		job_add(jobs, &n, i, THUMB_SCALE, -1, &r);
+	}
+	for(i = first - 1; i >= MAX(first - screen, 0); i--) {
+		thumb_dims(i, &r);
+		job_add(jobs, &n, i, THUMB_SCALE, -1, &r);
+	}
+	pool_request(jobs, n);
+	return got;
+}
+
+static void overview_scroll(long long y) {
+	long long rows = (page_count + overview_cols() - 1) / overview_cols();
+	long long ymax = THUMB_GAP + rows * CELL_H - ezsdl_get_height();
+	overview_y = MAX(MIN(y, ymax), 0);
+}
+
+/* scrolls the grid so the selected page is in view */
+static void overview_follow(void) {
+	long long top = (long long) overview_sel / overview_cols() * CELL_H;
+	if(top < overview_y)
+		overview_scroll(top);
+	else if(top + CELL_H + THUMB_GAP > overview_y + ezsdl_get_height())
+		overview_scroll(top + CELL_H + THUMB_GAP - ezsdl_get_height());
+}
+
+/* the page whose cell is at x, y of the window, -1 if none */
+static int overview_at(int x, int y) {
+	int cols = overview_cols(), col, pageno;
+	long long row = y + overview_y - THUMB_GAP;
+	x -= overview_left();
+	if(x < 0 || row < 0 || (col = x / CELL_W) >= cols) return -1;
+	pageno = row / CELL_H * cols + col;
+	return pageno < page_count ? pageno : -1;
+}
+
+static int overview_show(int on) {
+	int i;
+	overview = on;
+	if(on) {
+		overview_sel = curr_page;
+		overview_follow();
+		overview_update();
+	} else {
+		for(i = 0; i < page_count; i++) {
+			cache_release(thumbs[i]);
+			thumbs[i] = 0;
+		}
+		/* back to the pages around curr_page */
+		view_request(view_scale);
+	}
+	update_title();
+	return 2;
+}
+
+static int overview_jump(int pageno) {
+	overview_show(0);
+	scroll_line_v = 0;
+	set_page(pageno);
+	return 2;
+}
+
+/* the events while the overview is on. returns what needs redrawing */
+static int overview_input(enum eventtypes e, struct event *ev) {
+	int cols = overview_cols(), sel = overview_sel;
+	int screen = MAX(ezsdl_get_height() / CELL_H, 1) * cols;
+	switch(e) {
+	case EV_MOUSEWHEEL:
+		overview_scroll(overview_y + ev->yval * 64);
+		break;
+	case EV_MOUSEUP:
+		if(ev->which != SDL_BUTTON_LEFT || (sel = overview_at(ev->xval, ev->yval)) < 0)
+			return 0;
+		return overview_jump(sel);
+	case EV_KEYDOWN:
+		switch(ev->which) {
+			case SDLK_LEFT: sel--; break;
+			case SDLK_RIGHT: sel++; break;
+			case SDLK_UP: sel -= cols; break;
+			case SDLK_DOWN: sel += cols; break;
+			case SDLK_PAGEUP: sel -= screen; break;
+			case SDLK_PAGEDOWN: sel += screen; break;
+			default: return 0;
+		}
+		overview_sel = MAX(MIN(sel, page_count - 1), 0);
+		overview_follow();
+		update_title();
+		break;
+	case EV_KEYUP:
+		switch(ev->which) {
+			case SDLK_RETURN:
+				return overview_jump(overview_sel);
+			case SDLK_ESCAPE: case SDLK_t:
+				return overview_show(0);
+			default:
+				return 0;
+		}
+	case EV_NEEDREDRAW: case EV_RESIZE:
+		overview_follow();
+		break;
+	default:
+		return 0;
+	}
+	overview_update();
+	return 1;
+}
+
 #define HELP_TEXT \
 	"HELP SCREEN - HIT ANY KEY TO EXIT\n" \
 	"UP, DOWN ARROW - SCROLL 32 PIX\n" \
@@ -562,6 +3086,7 @@ static int change_scroll_h(int incr) {
 	"PAGE_UP/DOWN - SCROLL ONE PAGE\n" \
 	"KEYPAD +/- OR CTRL-WHEEL - ZOOM\n" \
 	"G - ENTER PAGE NUMBER\n" \
+	"T - PAGE OVERVIEW\n" \
 	"Q/ESC - QUIT\n" \
 	"F1 - SHOW HELP SCREEN\n"
 
@@ -591,8 +3116,10 @@ static void input_loop(const char* title, char *result, enum input_flags flags)
 	int ret_count = get_return_count(title);
 	if(!ret_count) ret_count = 1;
 	int desired_height = (ret_count+2) * 10 * 2;
+	ezsdl_begin_frame();
 	ezsdl_fill_rect(0,0, ezsdl_get_width(), MIN(desired_height, ezsdl_get_height()), RGB(0xff,0x00,0x00), 1);
 	draw_font_lines(title, &ss_font, 8, 8, 2);
+	ezsdl_end_frame();
 	ezsdl_update_region(0, 0, ezsdl_get_width(), MIN(desired_height, ezsdl_get_height()));
 	char* p = result;
 	*p = 0;
@@ -612,6 +3139,7 @@ static void input_loop(const char* title, char *result, enum input_flags flags)
 		out:;
 				*p = 0;
 				ezsdl_clear();
+				screen_stale = 1;
 				return;
 			default:
 				if(flags == INPUT_LOOP_RET)
@@ -621,8 +3149,10 @@ static void input_loop(const char* title, char *result, enum input_flags flags)
 					*p = 0;
 				}
 			drawit:
+				ezsdl_begin_frame();
 				ezsdl_fill_rect(8, desired_height - 10*2, ezsdl_get_width() -8, MIN(desired_height, ezsdl_get_height()), RGB(0xff,0x00,0x00), 1);
 				draw_font(result, &ss_font, 8, desired_height - 10*2, 2);
+				ezsdl_end_frame();
 				ezsdl_update_region(0, 0, ezsdl_get_width(), MIN(desired_height, ezsdl_get_height()));
 				break;
 			}
@@ -634,6 +3164,7 @@ static void input_loop(const char* title, char *result, enum input_flags flags)
 
 static void djvu_cleanup(void) {
 	if(!IS_DJVU) return;
+	djvu_decode_shutdown();
 	if(DDOC.doc)
 		ddjvu_document_release(DDOC.doc);
 	if(DDOC.ctx)
@@ -641,7 +3172,10 @@ static void djvu_cleanup(void) {
 }
 
 static void pdf_cleanup(void) {
+	int i;
 	if(IS_DJVU) return;
+	for(i = 0; i < MAX_DLISTS; i++)
+		pdf_drop_list(PDOC.ctx, &dlists[i]);
 	if(PDOC.doc)
 		fz_drop_document(PDOC.ctx, PDOC.doc);
 	if(PDOC.ctx)
@@ -649,6 +3183,23 @@ static void pdf_cleanup(void) {
 }
 
 static int cleanup(void) {
+	int i;
+	pool_shutdown();
+	if(config_data.stats) cache_print_stats();
+	for(i = 0; i < VIEW_MAX; i++)
+		free(view[i].tiles);
+#ifdef USE_SDL2
+	free(texs);
+#endif
+	cache_shutdown();
+	free(page_geom);
+	free(page_top);
+	free(disk.keys);
+	free(thumbs);
+	free(thumb_state);
+	free(page_broken);
+	for(i = 1; i <= FONT_MAX_SCALE; i++)
+		glyph_atlas_free(&font_atlases[i]);
 	djvu_cleanup();
 	pdf_cleanup();
 
@@ -680,9 +3231,27 @@ static void decode_doc(void) {
 	}
 }
 
+static pthread_mutex_t fz_mutexes[FZ_LOCK_MAX];
+
+static void fz_lock_cb(void *user, int lock) {
+	pthread_mutex_lock(&fz_mutexes[lock]);
+}
+
+static void fz_unlock_cb(void *user, int lock) {
+	pthread_mutex_unlock(&fz_mutexes[lock]);
+}
+
+static fz_locks_context fz_locks = {
+	.lock = fz_lock_cb,
+	.unlock = fz_unlock_cb,
+};
+
 static int open_pdf(const char *fn) {
+	int i;
 	doc.be = BE_MUPDF;
-	PDOC.ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	for(i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&fz_mutexes[i], 0);
+	PDOC.ctx = fz_new_context(NULL, &fz_locks, FZ_STORE_DEFAULT);
 	fz_register_document_handlers(PDOC.ctx);
 	fz_try (PDOC.ctx) {
 		PDOC.doc = fz_open_document(PDOC.ctx, fn);
@@ -717,10 +3286,20 @@ int main(int argc, char **argv) {
 		fz_count_pages(PDOC.ctx, PDOC.doc);
 
 	curr_page = 0;
+	if(!(page_geom = calloc(page_count, sizeof *page_geom)) ||
+	   !(page_top = calloc(page_count + 1, sizeof *page_top)) ||
+	   !(thumbs = calloc(page_count, sizeof *thumbs)) ||
+	   !(thumb_state = calloc(page_count, sizeof *thumb_state)) ||
+	   !(page_broken = calloc(page_count, sizeof *page_broken)))
+		die("out of memory");
+	page_index();
 
 	config_data.scale = 100;
 
 	read_write_config(1);
+	cache.budget = (size_t) config_data.cache_mb << 20;
+	cache.zbudget = (size_t) MAX(config_data.zcache_mb, 0) << 20;
+	disk_init(argv[1]);
 
 	ezsdl_init(config_data.w, config_data.h, 100,
 #ifndef USE_SDL2
@@ -730,8 +3309,17 @@ int main(int argc, char **argv) {
 #endif
 	);
 	ezsdl_set_resize_method(RM_WINDOW);
-
-	image_data = prep_pages(NULL);
+	ezsdl_get_pixel_masks(pixel_masks);
+	/* make sure the unused byte reads as opaque, like ARGB() */
+	if(!pixel_masks[3]) pixel_masks[3] = ~(pixel_masks[0] | pixel_masks[1] | pixel_masks[2]);
+
+	pool_init(config_data.threads > 0 ? config_data.threads :
+		  sysconf(_SC_NPROCESSORS_ONLN));
+	/* until a page tells its size, they are taken to be letter sized.
+	   the window shows placeholders and view_update_dims() corrects it
+	   as soon as one does. */
+	prepare_rect(&page_dims, 0, 850, 1100, 100, config_data.scale);
+	prep_pages(NULL);
 
 	init_gfx();
 
@@ -759,6 +3347,11 @@ int main(int argc, char **argv) {
 		enum eventtypes e;
 		while((e = ezsdl_getevent(&event)) != EV_NONE) {
 			need_redraw = 0;
+			if(overview && e != EV_QUIT) {
+				need_redraw = overview_input(e, &event);
+				if(need_redraw) game_tick(need_redraw);
+				continue;
+			}
 			switch (e) {
 				case EV_MOUSEDOWN:
 					if(event.which == SDL_BUTTON_LEFT) mb_left_down = 1;
@@ -878,8 +3471,12 @@ int main(int argc, char **argv) {
 								else need_redraw = 1;
 							}
 							break;
+						case SDLK_t:
+							need_redraw = overview_show(1);
+							break;
 						case SDLK_c:
 							ezsdl_clear();
+							screen_stale = 1;
 							ezsdl_refresh();
 							need_redraw = 1;
 							break;
@@ -896,6 +3493,7 @@ int main(int argc, char **argv) {
 		if(scroll_dist_v) need_redraw |= change_scroll_v(scroll_dist_v);
 		if(scroll_dist_h) need_redraw |= change_scroll_h(scroll_dist_h);
 		if(scale_dist) need_redraw |= change_scale(scale_dist);
+		need_redraw |= poll_pages();
 
 		if(game_tick(need_redraw)) {
 		}